@@ -20,26 +20,69 @@
  * SOFTWARE.
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cctype>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <numeric>
 #include <regex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
 
 #include "cxxopts.hpp"
 
 
-template <class T>
-void print(const T& v) {
-    std::copy(v.begin(), v.end(), std::ostream_iterator<typename T::value_type>(std::cout, " "));
-    std::cout << std::endl;
+size_t& threads() {
+    // Number of threads of parallel operations (default: hardware concurrency)
+    static size_t n = std::max(1U, std::thread::hardware_concurrency());
+    return n;
+}
+
+
+template <typename F>
+void parallel_for(size_t n, F&& f) {
+    // Calls f(chunk, begin, end) for threads() contiguous chunks of [0, n), concurrently
+    // Note: results should not depend on the partition (for reproducibility across thread counts)
+    const auto nchunks = threads();
+    std::vector<std::thread> workers;
+    for (size_t c = 1; c < nchunks; ++c) {
+        workers.emplace_back([&f, n, c, nchunks]() { f(c, n * c / nchunks, n * (c + 1) / nchunks); });
+    }
+    f(size_t(0), size_t(0), n / nchunks);
+    for (auto& w : workers) {
+        w.join();
+    }
 }
 
 
@@ -59,34 +102,175 @@ template <typename T>
 using iterator_t = decltype(std::begin(std::declval<T&>()));
 
 
+double position_n(size_t k, double x0, double dx) {
+    // Position x0 + k * dx, unfused whatever the target and compiler flags (bulk and scalar edges are the same values,
+    // and so are weights cached by differently built processes)
+    // Note: on FMA targets the product is rounded by a fused multiply-add of zero, which is not contracted further
+#if defined(__FMA__)
+    return x0 + std::fma(static_cast<double>(k), dx, 0.);
+#else
+    return x0 + static_cast<double>(k) * dx;
+#endif
+}
+
+
+void fill_midpoints(midpoint_t* out, size_t k0, size_t k1, size_t count, double x0, double x1, double lim0,
+                    double lim1, int label) {
+    // Midpoints [k0, k1] (of count + 1, between points of constant increment and the limits) into out[0, k1 - k0],
+    // vectorised (8 or 4 positions at a time, interleaved with the labels into pairs of midpoints), the same values
+    static_assert(sizeof(midpoint_t) == 16 && offsetof(midpoint_t, x) == 0 && offsetof(midpoint_t, i) == 8,
+                  "fill_midpoints: midpoint_t layout");
+    assert(0 < count && k0 <= k1 && k1 <= count);
+
+    const auto dx = count > 1 ? (x1 - x0) / static_cast<double>(count - 1) : 0.;
+    const auto xh = x0 - 0.5 * dx;  // Note: 0.5 * dx is exact, fused or not
+
+    auto k = k0;
+    if (k == 0) {
+        *out++ = {lim0, label};
+        ++k;
+    }
+    const auto last = std::min(k1 + 1, count);  // Note: interior midpoints [k, last)
+
+#if defined(__AVX512F__)
+    const auto L   = _mm512_castsi512_pd(_mm512_set1_epi64(static_cast<uint32_t>(label)));
+    const auto d   = _mm512_set1_pd(dx);
+    const auto h   = _mm512_set1_pd(xh);
+    const auto lo  = _mm512_set_epi64(8, 3, 8, 2, 8, 1, 8, 0);  // x0 L x1 L x2 L x3 L
+    const auto hi  = _mm512_set_epi64(8, 7, 8, 6, 8, 5, 8, 4);  // x4 L x5 L x6 L x7 L
+    const auto inc = _mm512_set_pd(7., 6., 5., 4., 3., 2., 1., 0.);
+    for (; k + 8 <= last; k += 8, out += 8) {
+        const auto i = _mm512_add_pd(_mm512_set1_pd(static_cast<double>(k)), inc);
+        const auto x = _mm512_add_pd(h, _mm512_fmadd_pd(i, d, _mm512_setzero_pd()));  // Note: unfused, as position_n
+        _mm512_storeu_pd(reinterpret_cast<double*>(out), _mm512_permutex2var_pd(x, lo, L));
+        _mm512_storeu_pd(reinterpret_cast<double*>(out + 4), _mm512_permutex2var_pd(x, hi, L));
+    }
+#elif defined(__AVX2__)
+    const auto L   = _mm256_castsi256_pd(_mm256_set1_epi64x(static_cast<uint32_t>(label)));
+    const auto d   = _mm256_set1_pd(dx);
+    const auto h   = _mm256_set1_pd(xh);
+    const auto inc = _mm256_set_pd(3., 2., 1., 0.);
+    for (; k + 4 <= last; k += 4, out += 4) {
+        const auto i = _mm256_add_pd(_mm256_set1_pd(static_cast<double>(k)), inc);
+#if defined(__FMA__)
+        const auto x = _mm256_add_pd(h, _mm256_fmadd_pd(i, d, _mm256_setzero_pd()));  // Note: unfused, as position_n
+#else
+        const auto x = _mm256_add_pd(h, _mm256_mul_pd(i, d));
+#endif
+        const auto a = _mm256_unpacklo_pd(x, L);  // x0 L x2 L
+        const auto b = _mm256_unpackhi_pd(x, L);  // x1 L x3 L
+        _mm256_storeu_pd(reinterpret_cast<double*>(out), _mm256_permute2f128_pd(a, b, 0x20));
+        _mm256_storeu_pd(reinterpret_cast<double*>(out + 2), _mm256_permute2f128_pd(a, b, 0x31));
+    }
+#endif
+    for (; k < last; ++k) {
+        *out++ = {position_n(k, xh, dx), label};
+    }
+
+    if (k1 == count) {
+        *out = {lim1, label};
+    }
+}
+
+
 void fill_midpoints_n(iterator_t<std::vector<midpoint_t>>& first, size_t count, double x0, double x1, double lim0,
-                      double lim1, int label, bool endpoint) {
+                      double lim1, int label) {
     // Assumes constant increment between point coordinates
-    // Note: if endpoint, advances first by count + 1
-    assert(1 < count);
+    // Note: advances first by count + 1
+    assert(0 < count);
+    fill_midpoints(&*first, 0, count, count, x0, x1, lim0, lim1, label);
+    first += static_cast<std::ptrdiff_t>(count + 1);
+}
 
-    const auto dx = (x1 - x0) / static_cast<double>(count - (endpoint ? 1 : 0));
-    x0 -= 0.5 * dx;
 
-    *first++ = {lim0, label};
-    for (size_t i = 1; i < count; ++i) {
-        *first++ = {x0 + i * dx, label};
+double midpoint_n(size_t k, size_t count, double x0, double x1, double lim0, double lim1) {
+    // Midpoint k (of count + 1) as filled by fill_midpoints, the same value
+    if (k == 0 || k == count) {
+        return k == 0 ? lim0 : lim1;
     }
+    const auto dx = (x1 - x0) / static_cast<double>(count - 1);
+    return position_n(k, x0 - 0.5 * dx, dx);
+}
+
 
-    if (endpoint) {
-        *first++ = {lim1, label};
+double point_n(size_t k, size_t count, double x0, double x1) {
+    // Point k (of count, constant increment), consistent with fill_midpoints_n
+    const auto dx = count > 1 ? (x1 - x0) / static_cast<double>(count - 1) : 0.;
+    return x0 + static_cast<double>(k) * dx;
+}
+
+
+template <typename Predicate>
+long bisect(long first, long last, Predicate pred) {
+    // First of [first, last) for which pred is false (pred is true then false), or last
+    while (first < last) {
+        const auto mid = first + (last - first) / 2;
+        if (pred(mid)) {
+            first = mid + 1;
+        }
+        else {
+            last = mid;
+        }
     }
+    return first;
 }
 
 
 double normalise_longitude(double lon, double minimum) {
-    while (lon < minimum) {
-        lon += 360.;
+    // Branch-free: one floor for any number of turns, then the (rounding) corrections as selects
+    lon -= 360. * std::floor((lon - minimum) / 360.);
+    lon += lon < minimum ? 360. : 0.;
+    lon -= lon >= minimum + 360. ? 360. : 0.;
+    return lon;
+}
+
+
+void normalise_longitudes(double* lon, size_t n, double minimum) {
+    // Bulk normalise_longitude, the same values
+    size_t k = 0;
+#if defined(__AVX512F__)
+    const auto m    = _mm512_set1_pd(minimum);
+    const auto m1   = _mm512_set1_pd(minimum + 360.);
+    const auto turn = _mm512_set1_pd(360.);
+    for (; k + 8 <= n; k += 8) {
+        auto x        = _mm512_loadu_pd(lon + k);
+        const auto q  = _mm512_mask_roundscale_pd(x, 0xff, _mm512_div_pd(_mm512_sub_pd(x, m), turn),
+                                                  _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        x             = _mm512_sub_pd(x, _mm512_mul_pd(turn, q));
+        x             = _mm512_mask_add_pd(x, _mm512_cmp_pd_mask(x, m, _CMP_LT_OQ), x, turn);
+        x             = _mm512_mask_sub_pd(x, _mm512_cmp_pd_mask(x, m1, _CMP_GE_OQ), x, turn);
+        _mm512_storeu_pd(lon + k, x);
     }
-    while (lon >= minimum + 360.) {
-        lon -= 360.;
+#elif defined(__AVX2__)
+    const auto m    = _mm256_set1_pd(minimum);
+    const auto m1   = _mm256_set1_pd(minimum + 360.);
+    const auto turn = _mm256_set1_pd(360.);
+    for (; k + 4 <= n; k += 4) {
+        auto x       = _mm256_loadu_pd(lon + k);
+        const auto q = _mm256_floor_pd(_mm256_div_pd(_mm256_sub_pd(x, m), turn));
+        x            = _mm256_sub_pd(x, _mm256_mul_pd(turn, q));
+        x            = _mm256_add_pd(x, _mm256_and_pd(_mm256_cmp_pd(x, m, _CMP_LT_OQ), turn));
+        x            = _mm256_sub_pd(x, _mm256_and_pd(_mm256_cmp_pd(x, m1, _CMP_GE_OQ), turn));
+        _mm256_storeu_pd(lon + k, x);
     }
-    return lon;
+#endif
+    for (; k < n; ++k) {
+        lon[k] = normalise_longitude(lon[k], minimum);
+    }
+}
+
+
+size_t rotate_longitudes(std::vector<double>& lon, double minimum) {
+    // Ascending longitudes (spanning less than one turn) normalised to [minimum, minimum + 360) and ascending again:
+    // normalising leaves two ascending runs, so the wrap is found by one bisection and undone by a rotation (returns
+    // the original position of the first)
+    normalise_longitudes(lon.data(), lon.size(), minimum);
+    if (lon.size() < 2) {
+        return 0;
+    }
+    const auto wrap = bisect(1, static_cast<long>(lon.size()), [&](long k) { return lon[k] >= lon.front(); });
+    std::rotate(lon.begin(), lon.begin() + wrap, lon.end());
+    return static_cast<size_t>(wrap) % lon.size();
 }
 
 
@@ -118,21 +302,6 @@ struct Area : protected std::array<double, 4> {
         return N() == other.N() && W() == other.W() && S() == other.S() && E() == other.E();
     }
 
-    bool in(const Area& other) const {
-        if (N() > other.N() || S() < other.S()) {
-            return false;
-        }
-        if (other.isPeriodicWestEast()) {
-            return true;
-        }
-        if (isPeriodicWestEast()) {
-            return false;
-        }
-
-        const auto other_W = normalise_longitude(other.W(), W());
-        return W() >= other_W && E() <= normalise_longitude(other.E(), other_W);
-    }
-
     bool includesNorthPole() const { return N() == 90.; }
     bool includesSouthPole() const { return S() == -90.; }
     bool isPeriodicWestEast() const { return E() == W() + 360.; }
@@ -164,10 +333,103 @@ struct Grid {
     virtual double firstXj() const    = 0;
     virtual double lastXj() const     = 0;
 
+    virtual double firstXi(size_t) const { return area_.W(); }
+    virtual double lastXi(size_t j) const {
+        return area_.isPeriodicWestEast() ? area_.W() + 360. * static_cast<double>(Ni(j) - 1) / Ni(j) : area_.E();
+    }
+
+    // Row j grid-box west/east limits (periodic rows are one full turn, starting half an increment before firstXi)
+    double westXi(size_t j) const { return area_.isPeriodicWestEast() ? firstXi(j) - 180. / Ni(j) : area_.W(); }
+    double eastXi(size_t j) const { return area_.isPeriodicWestEast() ? lastXi(j) + 180. / Ni(j) : area_.E(); }
+
+    // Global grid (whole globe) point indices, if a crop of it (otherwise empty)
+    virtual std::vector<size_t> global_indices() const { return {}; }
+
+    // Row starting indices, [Nj + 1] (last is the number of points), computed once
+    const std::vector<size_t>& offsets() const {
+        std::call_once(offsets_once_, [this]() {
+            offsets_.assign(Nj() + 1, 0);
+            for (size_t j = 0; j < Nj(); ++j) {
+                offsets_[j + 1] = offsets_[j] + Ni(j);
+            }
+        });
+        return offsets_;
+    }
+
+    // Grid-box areas (on the unit sphere, as the sweep intersections), rows in parallel
+    std::vector<double> areas() const {
+        constexpr double d2r = M_PI / 180.;
+
+        std::vector<midpoint_t> lat(Nj() + 1);
+        auto it = lat.begin();
+        fill_lat_edges(it, 0);
+
+        const auto& O  = offsets();
+        const auto lon = lon_edges();
+        std::vector<double> a(O.back());
+        parallel_for(Nj(), [&](size_t, size_t begin, size_t end) {
+            for (auto j = begin; j < end; ++j) {
+                const auto dy = std::sin(lat[j].x * d2r) - std::sin(lat[j + 1].x * d2r);
+                const auto* e = lon.data() + O[j] + j;
+                for (size_t i = 0; i < Ni(j); ++i) {
+                    a[O[j] + i] = (e[i + 1].x - e[i].x) * d2r * dy;
+                }
+            }
+        });
+        return a;
+    }
+
+    // Grid-box latitude edges (j-direction midpoints, reverse sorted as latitudes decrease), advances first by Nj + 1
+    void fill_lat_edges(iterator_t<std::vector<midpoint_t>>& first, int label) const {
+        fill_midpoints_n(first, Nj(), firstXj(), lastXj(), area_.N(), area_.S(), label);
+    }
+
+    // Grid-box longitude edges of row j (i-direction midpoints), advances first by Ni(j) + 1
+    void fill_lon_edges(iterator_t<std::vector<midpoint_t>>& first, size_t j, int label, double shift = 0.) const {
+        fill_midpoints_n(first, Ni(j), firstXi(j) + shift, lastXi(j) + shift, westXi(j) + shift, eastXi(j) + shift,
+                         label);
+    }
+
+    // Grid-box longitude edges [k0, k1] of row j (the same values), advances first by k1 - k0 + 1
+    void fill_lon_edges(iterator_t<std::vector<midpoint_t>>& first, size_t j, int label, double shift, size_t k0,
+                        size_t k1) const {
+        assert(k0 <= k1 && k1 <= Ni(j));
+        fill_midpoints(&*first, k0, k1, Ni(j), firstXi(j) + shift, lastXi(j) + shift, westXi(j) + shift,
+                       eastXi(j) + shift, label);
+        first += static_cast<std::ptrdiff_t>(k1 - k0 + 1);
+    }
+
+    // Grid-box longitude edges of all rows (row j from offsets()[j] + j, Ni(j) + 1 each, the same values), rows in
+    // parallel
+    std::vector<midpoint_t> lon_edges(int label = 0) const {
+        const auto& O = offsets();
+        std::vector<midpoint_t> M(O.back() + Nj());
+        parallel_for(Nj(), [&](size_t, size_t begin, size_t end) {
+            for (auto j = begin; j < end; ++j) {
+                fill_midpoints(M.data() + O[j] + j, 0, Ni(j), Ni(j), firstXi(j), lastXi(j), westXi(j), eastXi(j),
+                               label);
+            }
+        });
+        return M;
+    }
+
+    // Grid-box longitude edge k of row j (0 <= k <= Ni(j))
+    double lon_edge(size_t j, size_t k, double shift = 0.) const {
+        return midpoint_n(k, Ni(j), firstXi(j) + shift, lastXi(j) + shift, westXi(j) + shift, eastXi(j) + shift);
+    }
+
+    // Row j latitude, and longitude of its point i (the grid-box centres)
+    double pointXj(size_t j) const { return point_n(j, Nj(), firstXj(), lastXj()); }
+    double pointXi(size_t j, size_t i) const { return point_n(i, Ni(j), firstXi(j), lastXi(j)); }
+
 protected:
     Grid(const Area& area) : area_(area) {}
 
     const Area area_;
+
+private:
+    mutable std::once_flag offsets_once_;  // Note: grids are shared by threads
+    mutable std::vector<size_t> offsets_;
 };
 
 
@@ -177,33 +439,97 @@ protected:
 
     size_t Nj() const override { return N_.size(); }
     size_t Ni(size_t j) const override { return N_[j]; }
-    double firstXj() const override { return area_.N() - 90. / static_cast<double>(Nj()); }
-    double lastXj() const override { return area_.S() + 90. / static_cast<double>(Nj()); }
+    double firstXj() const override { return latitude(j0_); }
+    double lastXj() const override { return latitude(j0_ + Nj() - 1); }
+    double firstXi(size_t j) const override {
+        return static_cast<double>(I0_[j]) * (360. / static_cast<double>(global_[j0_ + j]));
+    }
+    double lastXi(size_t j) const override {
+        return firstXi(j) + 360. * static_cast<double>(N_[j] - 1) / static_cast<double>(global_[j0_ + j]);
+    }
+
+    std::vector<size_t> global_indices() const override {
+        size_t offset = 0;
+        for (size_t j = 0; j < j0_; ++j) {
+            offset += global_[j];
+        }
+
+        std::vector<size_t> idx;
+        for (size_t j = 0; j < Nj(); ++j) {
+            const auto n = static_cast<long>(global_[j0_ + j]);
+            for (size_t i = 0; i < N_[j]; ++i) {
+                idx.push_back(offset + static_cast<size_t>(((I0_[j] + static_cast<long>(i)) % n + n) % n));
+            }
+            offset += global_[j0_ + j];
+        }
+        return idx;
+    }
+
+    // Global row j latitude (regularly spaced, pole to pole)
+    double latitude(size_t j) const {
+        return 90. - 180. * (static_cast<double>(j) + 0.5) / static_cast<double>(global_.size());
+    }
+
+    // Crops global rows (of the given number of points) to the grid-boxes intersecting the area (partially, at the
+    // area limits), located by bisection; periodic rows keep all points, starting at the first not west of the area
+    void crop(std::vector<size_t>&& global) {
+        global_         = std::move(global);
+        const auto half = 90. / static_cast<double>(global_.size());  // Note: half the latitude increment
+        const auto NjG  = static_cast<long>(global_.size());
+
+        j0_           = static_cast<size_t>(bisect(0, NjG, [&](long j) { return latitude(j) - half >= area_.N(); }));
+        const auto j1 = static_cast<size_t>(bisect(0, NjG, [&](long j) { return latitude(j) + half > area_.S(); }));
+        if (j0_ >= j1) {
+            throw std::runtime_error("GaussianGrid: no rows in area");
+        }
+
+        N_.clear();
+        I0_.clear();
+        for (auto j = j0_; j < j1; ++j) {
+            const auto dx = 360. / static_cast<double>(global_[j]);
+            const auto W  = area_.W();
+            const auto E  = area_.E();
+            const auto lo = static_cast<long>(std::floor(W / dx)) - 1;
+            const auto hi = static_cast<long>(std::ceil(E / dx)) + 2;
+
+            const auto i0 = area_.isPeriodicWestEast()
+                                ? bisect(lo, hi, [&](long i) { return static_cast<double>(i) * dx < W; })
+                                : bisect(lo, hi, [&](long i) { return (static_cast<double>(i) + 0.5) * dx <= W; });
+            const auto i1 = area_.isPeriodicWestEast()
+                                ? i0 + static_cast<long>(global_[j])
+                                : bisect(lo, hi, [&](long i) { return (static_cast<double>(i) - 0.5) * dx < E; });
+
+            N_.push_back(static_cast<size_t>(i1 - i0));
+            I0_.push_back(i0);
+        }
+    }
 
-    std::vector<size_t> N_;
+    std::vector<size_t> global_;  // global number of points per row
+    size_t j0_ = 0;               // first row
+    std::vector<size_t> N_;       // number of points per (cropped) row
+    std::vector<long> I0_;        // first point per (cropped) row, global (possibly negative, periodic)
 };
 
 
 struct OGrid : GaussianGrid {
     OGrid(size_t N, const Area& area) : GaussianGrid(area) {
-        assert(area == GLOBE);  // Note: for simplicity
         assert(N > 0);
 
-        N_.resize(2 * N);
-        auto a = N_.begin();
-        auto b = N_.rbegin();
+        std::vector<size_t> global(2 * N);
+        auto a = global.begin();
+        auto b = global.rbegin();
         for (size_t i = 0; i < N; ++i, ++a, ++b) {
             *a = *b = 20 + i * 4;
         }
+        crop(std::move(global));
     }
 };
 
 
 struct FGrid : GaussianGrid {
     FGrid(size_t N, const Area& area) : GaussianGrid(area) {
-        assert(area == GLOBE);  // Note: for simplicity
         assert(N > 0);
-        N_.assign(2 * N, 4 * N);
+        crop(std::vector<size_t>(2 * N, 4 * N));
     }
 };
 
@@ -248,55 +574,3336 @@ Grid* Grid::build(const std::string& name, const Area& area) {
 }
 
 
-int main(int argc, const char* argv[]) {
-    try {
-        // options
-        std::unique_ptr<cxxopts::Options> parser(
-            new cxxopts::Options(argv[0], " - grid-box intersections interpolation method"));
+std::string canonical(const std::string& name) {
+    // Grid name as registered (O and F grids are also named in lowercase)
+    auto c = name;
+    if (!c.empty() && (c[0] == 'o' || c[0] == 'f')) {
+        c[0] = static_cast<char>(std::toupper(c[0]));
+    }
+    return c;
+}
 
 
-        parser->add_options()("h,help", "Print help");
-        parser->add_options()("input-grid", "Input grid", cxxopts::value<std::string>()->default_value("O9"));
-        parser->add_options()("input-area", "Input area", cxxopts::value<std::string>()->default_value(GLOBE_STR));
-        parser->add_options()("output-grid", "Output grid", cxxopts::value<std::string>()->default_value("O45"));
-        parser->add_options()("output-area", "Output area", cxxopts::value<std::string>()->default_value(GLOBE_STR));
+std::shared_ptr<const Grid> grid(const std::string& name, const Area& area = GLOBE) {
+    // Interned grids: each distinct grid (by canonical name and exact area) is built once and shared, immutable (so
+    // handles are safe to use from many threads); lookups take a lock but do not parse
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::shared_ptr<const Grid>> grids;
 
-        parser->parse_positional({"input-grid", "output-grid"});
+    std::ostringstream key;
+    key << canonical(name) << '@' << std::hexfloat << area.N() << '/' << area.W() << '/' << area.S() << '/' << area.E();
 
-        auto options = parser->parse(argc, argv);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = grids.find(key.str());
+        if (it != grids.end()) {
+            return it->second;
+        }
+    }
 
-        if (options.count("help")) {
-            std::cout << parser->help() << std::endl;
-            return 0;
+    // Note: built outside of the lock, the first registered is kept if built concurrently
+    std::shared_ptr<const Grid> G(Grid::build(name, area));
+    std::lock_guard<std::mutex> lock(mutex);
+    return grids.emplace(key.str(), std::move(G)).first->second;
+}
+
+
+struct Locator {
+    // Containing grid-box of points (latitude, longitude) in constant time: the row and the point in it are the
+    // closest by their (constant) increments, in closed form from per-row tables; batched in SIMD, the same results
+    static constexpr size_t outside = std::numeric_limits<size_t>::max();
+
+    explicit Locator(const Grid& G) :
+        N_(G.area().N()),
+        S_(G.area().S()),
+        W_(G.area().W()),
+        E_(G.area().E()),
+        periodic_(G.area().isPeriodicWestEast()),
+        y0_(G.pointXj(0)),
+        dy_(G.Nj() > 1 ? (G.pointXj(G.Nj() - 1) - y0_) / static_cast<double>(G.Nj() - 1) : -180.),
+        nj_(static_cast<double>(G.Nj())) {
+        const auto& O = G.offsets();
+        for (size_t j = 0; j < G.Nj(); ++j) {
+            const auto n = G.Ni(j);
+            x0_.push_back(G.pointXi(j, 0));
+            dx_.push_back(n > 1 ? (G.pointXi(j, n - 1) - x0_.back()) / static_cast<double>(n - 1) : 360.);
+            ni_.push_back(static_cast<double>(n));
+            first_.push_back(static_cast<double>(O[j]));
         }
+    }
 
+    size_t operator()(double lat, double lon) const {
+        lon = normalise_longitude(lon, W_);
+        if (!(S_ <= lat && lat <= N_) || !std::isfinite(lon) || !(periodic_ || lon <= E_)) {
+            return outside;
+        }
 
-        // input and output grids
+        const auto j = static_cast<size_t>(std::max(0., std::min(nj_ - 1., std::floor((lat - y0_) / dy_ + 0.5))));
+        auto i       = std::floor((lon - x0_[j]) / dx_[j] + 0.5);
+        i = periodic_ ? i - ni_[j] * std::floor(i / ni_[j]) : std::max(0., std::min(ni_[j] - 1., i));
+        return static_cast<size_t>(first_[j] + i);
+    }
+
+    void operator()(const double* lat, const double* lon, size_t n, size_t* index) const {
+        // Note: blocks of longitudes are normalised in bulk, then rows and points located by vector gathers
+        constexpr size_t B = 256;
+        double x[B];
+        double r[B];
+        for (size_t b = 0; b < n; b += B) {
+            const auto m = std::min(B, n - b);
+            std::copy(lon + b, lon + b + m, x);
+            normalise_longitudes(x, m, W_);
+
+            size_t k = 0;
+#if defined(__AVX512F__)
+            const auto N = _mm512_set1_pd(N_), S = _mm512_set1_pd(S_), E = _mm512_set1_pd(E_);
+            const auto y0 = _mm512_set1_pd(y0_), dy = _mm512_set1_pd(dy_), last = _mm512_set1_pd(nj_ - 1.);
+            const auto zero = _mm512_setzero_pd(), half = _mm512_set1_pd(0.5), one = _mm512_set1_pd(1.);
+            const auto nan  = _mm512_set1_pd(NAN);
+            constexpr int down = _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC;
+            for (; k + 8 <= m; k += 8) {
+                const auto y = _mm512_loadu_pd(lat + b + k);
+                const auto l = _mm512_loadu_pd(x + k);
+
+                auto t = _mm512_add_pd(_mm512_div_pd(_mm512_sub_pd(y, y0), dy), half);
+                t      = _mm512_mask_roundscale_pd(t, 0xff, t, down);
+                t      = _mm512_maskz_max_pd(0xff, zero, _mm512_maskz_min_pd(0xff, last, t));
+
+                // Note: NaN latitudes (kept by min/max) gather row 0, and are outside by the ordered comparisons
+                const auto j = _mm512_maskz_cvttpd_epi32(_mm512_cmp_pd_mask(y, y, _CMP_ORD_Q), t);
+
+                const auto x0 = _mm512_mask_i32gather_pd(zero, 0xff, j, x0_.data(), 8);
+                const auto dx = _mm512_mask_i32gather_pd(zero, 0xff, j, dx_.data(), 8);
+                const auto ni = _mm512_mask_i32gather_pd(zero, 0xff, j, ni_.data(), 8);
+                const auto f  = _mm512_mask_i32gather_pd(zero, 0xff, j, first_.data(), 8);
+
+                auto i = _mm512_add_pd(_mm512_div_pd(_mm512_sub_pd(l, x0), dx), half);
+                i      = _mm512_mask_roundscale_pd(i, 0xff, i, down);
+                if (periodic_) {
+                    const auto q = _mm512_div_pd(i, ni);
+                    i = _mm512_sub_pd(i, _mm512_mul_pd(ni, _mm512_mask_roundscale_pd(q, 0xff, q, down)));
+                }
+                else {
+                    i = _mm512_maskz_max_pd(0xff, zero, _mm512_maskz_min_pd(0xff, _mm512_sub_pd(ni, one), i));
+                }
+
+                auto in = _mm512_cmp_pd_mask(S, y, _CMP_LE_OQ) & _mm512_cmp_pd_mask(y, N, _CMP_LE_OQ);
+                if (!periodic_) {
+                    in &= _mm512_cmp_pd_mask(l, E, _CMP_LE_OQ);
+                }
+                _mm512_storeu_pd(r + k, _mm512_mask_add_pd(nan, in, f, i));
+            }
+#elif defined(__AVX2__)
+            const auto N = _mm256_set1_pd(N_), S = _mm256_set1_pd(S_), E = _mm256_set1_pd(E_);
+            const auto y0 = _mm256_set1_pd(y0_), dy = _mm256_set1_pd(dy_), last = _mm256_set1_pd(nj_ - 1.);
+            const auto zero = _mm256_setzero_pd(), half = _mm256_set1_pd(0.5), nan = _mm256_set1_pd(NAN);
+            for (; k + 4 <= m; k += 4) {
+                const auto y = _mm256_loadu_pd(lat + b + k);
+                const auto l = _mm256_loadu_pd(x + k);
+
+                auto t = _mm256_add_pd(_mm256_div_pd(_mm256_sub_pd(y, y0), dy), half);
+                t      = _mm256_max_pd(zero, _mm256_min_pd(last, _mm256_floor_pd(t)));
+
+                // Note: NaN latitudes (kept by min/max) gather row 0, and are outside by the ordered comparisons
+                const auto j = _mm256_cvttpd_epi32(_mm256_and_pd(t, _mm256_cmp_pd(y, y, _CMP_ORD_Q)));
+
+                const auto x0 = _mm256_i32gather_pd(x0_.data(), j, 8);
+                const auto dx = _mm256_i32gather_pd(dx_.data(), j, 8);
+                const auto ni = _mm256_i32gather_pd(ni_.data(), j, 8);
+                const auto f  = _mm256_i32gather_pd(first_.data(), j, 8);
+
+                auto i = _mm256_floor_pd(_mm256_add_pd(_mm256_div_pd(_mm256_sub_pd(l, x0), dx), half));
+                i      = periodic_ ? _mm256_sub_pd(i, _mm256_mul_pd(ni, _mm256_floor_pd(_mm256_div_pd(i, ni))))
+                                   : _mm256_max_pd(zero, _mm256_min_pd(_mm256_sub_pd(ni, _mm256_set1_pd(1.)), i));
+
+                auto in = _mm256_and_pd(_mm256_cmp_pd(S, y, _CMP_LE_OQ), _mm256_cmp_pd(y, N, _CMP_LE_OQ));
+                if (!periodic_) {
+                    in = _mm256_and_pd(in, _mm256_cmp_pd(l, E, _CMP_LE_OQ));
+                }
+                _mm256_storeu_pd(r + k, _mm256_blendv_pd(nan, _mm256_add_pd(f, i), in));
+            }
+#endif
+            for (; k < m; ++k) {
+                const auto idx = (*this)(lat[b + k], x[k]);
+                r[k]           = idx == outside ? NAN : static_cast<double>(idx);
+            }
+
+            for (k = 0; k < m; ++k) {
+                index[b + k] = std::isnan(r[k]) ? outside : static_cast<size_t>(r[k]);
+            }
+        }
+    }
+
+private:
+    const double N_;
+    const double S_;
+    const double W_;
+    const double E_;
+    const bool periodic_;
+    const double y0_;
+    const double dy_;
+    const double nj_;
+    std::vector<double> x0_;
+    std::vector<double> dx_;
+    std::vector<double> ni_;
+    std::vector<double> first_;
+};
+
+
+template <typename Compare>
+void merge_k(std::vector<midpoint_t>& M, const std::vector<size_t>& bounds, Compare cmp,
+             std::vector<midpoint_t>& buffer, std::vector<std::pair<size_t, size_t>>& heads) {
+    // Merges sorted sequences [bounds[n], bounds[n + 1]) of M into buffer, then swapped: two with std::merge, more
+    // with a heap of the sequences heads (buffer and heads are reused between calls, no allocations once grown)
+    const auto n = bounds.size() - 1;
+    if (n < 2) {
+        return;
+    }
 
-        std::unique_ptr<Grid> Gi(
-            Grid::build(options["input-grid"].as<std::string>(), {options["input-area"].as<std::string>()}));
-        std::unique_ptr<Grid> Go(
-            Grid::build(options["output-grid"].as<std::string>(), {options["output-area"].as<std::string>()}));
-        assert(Go->area().in(Gi->area()));
+    buffer.resize(M.size());
+    if (n == 2) {
+        const auto mid = M.begin() + static_cast<std::ptrdiff_t>(bounds[1]);
+        std::merge(M.begin(), mid, mid, M.end(), buffer.begin(), cmp);
+        M.swap(buffer);
+        return;
+    }
 
+    auto later = [&M, &cmp](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) {
+        return cmp(M[b.first], M[a.first]);
+    };
 
-        // Grid-box latitude edges (j-direction midpoints, reverse sorted as latitudes decrease)
-        std::vector<midpoint_t> Mj(Gi->Nj() + 1 + Go->Nj() + 1);
-        {
-            auto it = Mj.begin();
-            fill_midpoints_n(it, Gi->Nj(), Gi->firstXj(), Gi->lastXj(), Gi->area().N(), Gi->area().S(), 0, true);
-            fill_midpoints_n(it, Go->Nj(), Go->firstXj(), Go->lastXj(), Go->area().N(), Go->area().S(), 1, true);
-            assert(it == Mj.end());
+    heads.clear();
+    for (size_t s = 0; s < n; ++s) {
+        if (bounds[s] < bounds[s + 1]) {
+            heads.emplace_back(bounds[s], bounds[s + 1]);
+        }
+    }
+    std::make_heap(heads.begin(), heads.end(), later);
+
+    for (auto out = buffer.begin(); !heads.empty(); ++out) {
+        std::pop_heap(heads.begin(), heads.end(), later);
+        auto& h = heads.back();
+        *out    = M[h.first++];
+        if (h.first < h.second) {
+            std::push_heap(heads.begin(), heads.end(), later);
+        }
+        else {
+            heads.pop_back();
         }
+    }
+
+    M.swap(buffer);
+}
+
+
+double& snap_tolerance() {
+    // Coincident edges tolerance (degrees, default: none)
+    static double tol = 0.;
+    return tol;
+}
 
-        std::inplace_merge(
-            Mj.begin(), Mj.begin() + Gi->Nj() + 1, Mj.end(),
-            [](const midpoint_t& a, const midpoint_t& b) { return a.x > b.x || (a.x == b.x && a.i < b.i); });
 
-        print(Mj);
+void snap(std::vector<midpoint_t>& M, double tol) {
+    // Merged edges closer than tol to the previous are moved onto it, so nearly coincident edges (of nested grids, up
+    // to rounding) make no sliver intersections; the order is kept, so grid-boxes are counted as before
+    for (size_t k = 1; k < M.size(); ++k) {
+        if (std::abs(M[k].x - M[k - 1].x) < tol) {
+            M[k].x = M[k - 1].x;
+        }
     }
-    catch (const cxxopts::exceptions::exception& e) {
-        std::cout << "error parsing options: " << e.what() << std::endl;
+}
+
+
+struct overlap_t {
+    size_t g;  // output grid
+    size_t o;  // output index
+    size_t i;  // input index
+    double area;
+    double dlat;  // centroid, relative to the input grid-box centroid (degrees)
+    double dlon;
+};
+
+
+struct Overlaps {
+    // Non-empty grid-box intersections as a lazy range, by increasing output row of each output grid: latitude bands
+    // are set up one at a time when the previous is exhausted (input edges are generated and traversed once for all
+    // output grids), reusing the same buffers, so no allocations after the largest band
+    Overlaps(const Grid& Gi, const std::vector<const Grid*>& Go, double tol = snap_tolerance()) :
+        Gi_(Gi), Go_(Go), Oi_(Gi.offsets()), tol_(tol) {
+        // Grid-box latitude edges, merged (labelled 0 for input, and k + 1 for output grid k)
+        bounds_.assign({0, Gi.Nj() + 1});
+        for (const auto* G : Go) {
+            bounds_.push_back(bounds_.back() + G->Nj() + 1);
+        }
+
+        Mj_.resize(bounds_.back());
+        auto it = Mj_.begin();
+        Gi.fill_lat_edges(it, 0);
+        for (size_t k = 0; k < Go.size(); ++k) {
+            Go[k]->fill_lat_edges(it, static_cast<int>(k + 1));
+        }
+        assert(it == Mj_.end());
+
+        merge_k(Mj_, bounds_, descending, buffer_, heads_);
+        if (tol_ > 0.) {
+            snap(Mj_, tol_);
+        }
+
+        for (const auto* G : Go) {
+            Oo_.push_back(&G->offsets());
+        }
+        nj_.assign(Go.size() + 1, 0);
+        ni_seen_.resize(Go.size() + 1);
+
+        std::vector<midpoint_t> lat(Gi.Nj() + 1);
+        it = lat.begin();
+        Gi.fill_lat_edges(it, 0);
+        for (size_t j = 0; j < Gi.Nj(); ++j) {
+            latc_.push_back(centroid(lat[j].x, lat[j + 1].x));
+        }
+    }
+
+    // Next intersection, if any
+    bool next(overlap_t& out) {
+        constexpr double d2r = M_PI / 180.;
+        for (;;) {
+            // Longitude segments, each the intersection of an input and the output grids grid-boxes (the input segment
+            // after the first turn is a gap, and edges before k0 and q0 are counted); consecutive segments of the same
+            // grid-boxes are accumulated, and emitted when they change
+            // (with their first moment, relative to the input grid-box centroid)
+            // Note: the state is kept in locals (not aliased by the rows), and saved when an intersection is emitted
+            const auto nm = Mi_.size();
+            const auto na = active_.size();
+            auto* seen    = ni_seen_.data();
+            auto m        = m_;
+            auto a        = r_;
+            auto ii       = ii_;
+            auto dx       = dx_;
+            auto dm       = dm_;
+            auto sc       = sc_;
+            auto xc       = xc_;
+            for (; m + 1 < nm; ++m, a = 0) {
+                if (a == 0) {
+                    ++seen[static_cast<size_t>(Mi_[m].i)];
+                    const auto s = seen[0];
+                    if (s == 0 || s == ni_ + 1 || s > 2 * ni_ + 1 || !(Mi_[m].x < Mi_[m + 1].x)) {
+                        continue;
+                    }
+                    if (s != sc) {
+                        sc = s;
+                        xc = s <= ni_ ? lon_centroid(s - 1) : lon_centroid(s - ni_ - 2) + 360.;
+                    }
+                    ii = Oi_[ji_] + (s <= ni_ ? s - 1 : s - ni_ - 2);
+                    dx = Mi_[m + 1].x - Mi_[m].x;
+                    dm = dx * (0.5 * (Mi_[m].x + Mi_[m + 1].x) - xc);
+                }
+
+                while (a < na) {
+                    auto& r       = active_[a++];
+                    const auto io = seen[r.g + 1];
+                    if (io == 0 || io > r.N || (!r.twice && seen[0] > ni_ + 1)) {
+                        continue;  // Note: the input row second turn only for output rows extending into it
+                    }
+
+                    const auto o = r.first + io - 1;
+                    if (r.area > 0. && (r.o != o || r.i != ii)) {
+                        out = {r.g, r.o, r.i, r.area * d2r * dy_, dlat_, r.moment / r.area};
+                        r   = {r.g, r.j, r.N, r.first, o, ii, dx, dm, r.shift, r.q0, r.q1, r.twice};
+                        m_  = m;
+                        r_  = a;
+                        ii_ = ii;
+                        dx_ = dx;
+                        dm_ = dm;
+                        sc_ = sc;
+                        xc_ = xc;
+                        return true;
+                    }
+                    r.o = o;
+                    r.i = ii;
+                    r.area += dx;
+                    r.moment += dm;
+                }
+            }
+            m_  = m;
+            r_  = 0;
+            sc_ = sc;
+            xc_ = xc;
+
+            // pending intersections of the band
+            while (flush_ < active_.size()) {
+                const auto& r = active_[flush_++];
+                if (r.area > 0.) {
+                    out = {r.g, r.o, r.i, r.area * d2r * dy_, dlat_, r.moment / r.area};
+                    return true;
+                }
+            }
+
+            if (!band()) {
+                return false;
+            }
+        }
+    }
+
+    struct iterator {
+        using iterator_category = std::input_iterator_tag;
+        using value_type        = overlap_t;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const overlap_t*;
+        using reference         = const overlap_t&;
+
+        reference operator*() const { return t; }
+        pointer operator->() const { return &t; }
+        iterator& operator++() {
+            if (!range->next(t)) {
+                range = nullptr;
+            }
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+        bool operator==(const iterator& other) const { return range == other.range; }
+        bool operator!=(const iterator& other) const { return range != other.range; }
+
+        Overlaps* range = nullptr;
+        overlap_t t{};
+    };
+
+    // Note: single pass, begin() starts from the current position
+    iterator begin() { return ++iterator{this}; }
+    iterator end() { return {}; }
+
+private:
+    static bool descending(const midpoint_t& a, const midpoint_t& b) { return a.x > b.x || (a.x == b.x && a.i < b.i); }
+    static bool ascending(const midpoint_t& a, const midpoint_t& b) { return a.x < b.x || (a.x == b.x && a.i < b.i); }
+
+    // Latitude of the centroid of the band between latitudes a and b (degrees)
+    static double centroid(double a, double b) {
+        constexpr double d2r = M_PI / 180.;
+        const auto pa        = a * d2r;
+        const auto pb        = b * d2r;
+        return (pa * std::sin(pa) + std::cos(pa) - pb * std::sin(pb) - std::cos(pb)) /
+               (std::sin(pa) - std::sin(pb)) / d2r;
+    }
+
+    // Longitude of the centroid of input row grid-box k (first turn)
+    double lon_centroid(size_t k) const {
+        return 0.5 * (midpoint_n(k, ni_, x0_, x1_, w_, e_) + midpoint_n(k + 1, ni_, x0_, x1_, w_, e_));
+    }
+
+    // Sets up the next latitude band with output rows, if any: the intersection of an input row and output grids rows
+    bool band() {
+        constexpr double d2r = M_PI / 180.;
+        for (; k_ + 1 < Mj_.size(); ++k_) {
+            ++nj_[static_cast<size_t>(Mj_[k_].i)];
+            if (nj_[0] == 0 || nj_[0] > Gi_.Nj() || !(Mj_[k_ + 1].x < Mj_[k_].x)) {
+                continue;
+            }
+
+            active_.clear();
+            for (size_t g = 0; g < Go_.size(); ++g) {
+                if (nj_[g + 1] != 0 && nj_[g + 1] <= Go_[g]->Nj()) {
+                    const auto jo = nj_[g + 1] - 1;
+                    active_.push_back({g, jo, Go_[g]->Ni(jo), (*Oo_[g])[jo], 0, 0, 0., 0., 0., 0, 0, false});
+                }
+            }
+            if (active_.empty()) {
+                continue;
+            }
+
+            ji_   = nj_[0] - 1;
+            dy_   = std::sin(Mj_[k_].x * d2r) - std::sin(Mj_[k_ + 1].x * d2r);
+            dlat_ = centroid(Mj_[k_].x, Mj_[k_ + 1].x) - latc_[ji_];
+            ++k_;
+            lon_edges();
+
+            m_     = 0;
+            r_     = 0;
+            sc_    = 0;
+            flush_ = 0;
+            return true;
+        }
+        return false;
+    }
+
+    // Grid-box longitude edges of the band, merged (output rows shifted to start inside the input row, which is
+    // repeated one turn eastwards if any output row extends beyond it)
+    void lon_edges() {
+        const auto& Gi = Gi_;
+        const auto& Go = Go_;
+        const auto ji  = ji_;
+        const auto ni  = ni_ = Gi.Ni(ji);
+
+        x0_ = Gi.firstXi(ji);
+        x1_ = Gi.lastXi(ji);
+        w_  = Gi.westXi(ji);
+        e_  = Gi.eastXi(ji);
+
+        auto shift = [&](const row_t& r) {
+            return normalise_longitude(Go[r.g]->westXi(r.j), Gi.westXi(ji)) - Go[r.g]->westXi(r.j);
+        };
+
+        const auto west = Gi.westXi(ji);
+        const auto turn = Gi.area().isPeriodicWestEast() ? Gi.eastXi(ji) : west + 360.;
+
+        auto twice = false;
+        for (auto& r : active_) {
+            r.shift = shift(r);
+            r.twice = Go[r.g]->eastXi(r.j) + r.shift > turn;
+            twice   = twice || r.twice;
+        }
+
+        // Output edges [q0, q1] within the input row, and input edges [k0, k1] spanning them, by bisection (so partial
+        // overlaps cost as the intersection, and regional outputs as the region)
+        const auto east = twice ? Gi.eastXi(ji) + 360. : Gi.eastXi(ji);
+
+        auto lo = std::numeric_limits<double>::infinity();
+        auto hi = -lo;
+        for (auto& r : active_) {
+            const auto nq = static_cast<long>(r.N + 1);
+            auto edge     = [&](long q) { return Go[r.g]->lon_edge(r.j, static_cast<size_t>(q), r.shift); };
+
+            r.q0 = static_cast<size_t>(std::max(bisect(0, nq, [&](long q) { return edge(q) <= west; }) - 1, 0L));
+            r.q1 = static_cast<size_t>(std::min(bisect(0, nq, [&](long q) { return edge(q) < east; }), nq - 1));
+            lo   = std::min(lo, edge(static_cast<long>(r.q0)));
+            hi   = std::max(hi, edge(static_cast<long>(r.q1)));
+        }
+
+        const auto nk = static_cast<long>((ni + 1) * (twice ? 2 : 1));
+        auto edge     = [&](long k) {
+            const auto kk = static_cast<size_t>(k);
+            return kk <= ni ? Gi.lon_edge(ji, kk) : Gi.lon_edge(ji, kk - ni - 1, 360.);
+        };
+
+        const auto k0 = static_cast<size_t>(std::max(bisect(0, nk, [&](long k) { return edge(k) <= lo; }) - 1, 0L));
+        const auto k1 = static_cast<size_t>(std::min(bisect(0, nk, [&](long k) { return edge(k) < hi; }), nk - 1));
+
+        bounds_.assign({0, k1 - k0 + 1});
+        for (const auto& r : active_) {
+            bounds_.push_back(bounds_.back() + r.q1 - r.q0 + 1);
+        }
+
+        Mi_.resize(bounds_.back());
+        auto it = Mi_.begin();
+        if (k0 <= ni) {
+            Gi.fill_lon_edges(it, ji, 0, 0., k0, std::min(k1, ni));
+        }
+        if (k1 > ni) {
+            Gi.fill_lon_edges(it, ji, 0, 360., std::max(k0, ni + 1) - ni - 1, k1 - ni - 1);
+        }
+        for (const auto& r : active_) {
+            Go[r.g]->fill_lon_edges(it, r.j, static_cast<int>(r.g + 1), r.shift, r.q0, r.q1);
+        }
+        assert(it == Mi_.end());
+
+        merge_k(Mi_, bounds_, ascending, buffer_, heads_);
+        if (tol_ > 0.) {
+            snap(Mi_, tol_);
+        }
+
+        std::fill(ni_seen_.begin(), ni_seen_.end(), 0);
+        ni_seen_[0] = k0;
+        for (const auto& r : active_) {
+            ni_seen_[r.g + 1] = r.q0;
+        }
+    }
+
+    struct row_t {
+        size_t g;
+        size_t j;
+        size_t N;
+        size_t first;  // output index
+        size_t o;      // pending intersection (consecutive segments of the same grid-boxes, accumulated)
+        size_t i;
+        double area;
+        double moment;
+        double shift;  // longitude edges [q0, q1], shifted
+        size_t q0;
+        size_t q1;
+        bool twice;  // extends beyond the input row (so each output row has the same segments as if swept alone)
+    };
+
+    const Grid& Gi_;
+    const std::vector<const Grid*> Go_;
+    const std::vector<size_t>& Oi_;
+    std::vector<const std::vector<size_t>*> Oo_;  // Note: offsets of the grids, not copies
+    const double tol_;
+
+    std::vector<midpoint_t> Mj_;
+    std::vector<midpoint_t> Mi_;
+    std::vector<midpoint_t> buffer_;
+    std::vector<std::pair<size_t, size_t>> heads_;
+    std::vector<size_t> bounds_;
+    std::vector<size_t> nj_;
+    std::vector<size_t> ni_seen_;
+    std::vector<row_t> active_;
+    std::vector<double> latc_;  // input rows centroid latitude
+
+    size_t k_     = 0;  // next latitude band
+    size_t ji_    = 0;  // input row, its number of points and longitude limits
+    size_t ni_    = 0;
+    double x0_    = 0.;
+    double x1_    = 0.;
+    double w_     = 0.;
+    double e_     = 0.;
+    double dy_    = 0.;
+    double dlat_  = 0.;  // band centroid, relative to the input row centroid
+    size_t m_     = 0;  // next longitude segment, and its active row
+    size_t r_     = 0;
+    size_t ii_    = 0;  // segment input index, length and first moment
+    double dx_    = 0.;
+    double dm_    = 0.;
+    size_t sc_    = 0;  // segment input grid-box (as counted) and its centroid longitude
+    double xc_    = 0.;
+    size_t flush_ = 0;  // next active row to emit at the end of the band
+};
+
+#if defined(__cpp_lib_ranges)
+static_assert(std::ranges::input_range<Overlaps>, "Overlaps: not an input range");
+#endif
+
+
+template <typename Overlap>
+void sweep(const Grid& Gi, const std::vector<const Grid*>& Go, Overlap&& overlap) {
+    // Calls overlap(output grid, output index, input index, area) for each non-empty grid-box intersection, by
+    // increasing output row of each output grid
+    Overlaps overlaps(Gi, Go);
+    for (overlap_t t; overlaps.next(t);) {
+        overlap(t.g, t.o, t.i, t.area);
+    }
+}
+
+
+template <typename Overlap>
+void sweep(const Grid& Gi, const Grid& Go, Overlap&& overlap) {
+    // Calls overlap(output index, input index, area) for each non-empty grid-box intersection, by increasing output row
+    sweep(Gi, std::vector<const Grid*>{&Go},
+          [&overlap](size_t, size_t o, size_t i, double area) { overlap(o, i, area); });
+}
+
+
+struct bracket_t {
+    // Input points around an output point: the rows north and south of it (the same if only one), and in each the
+    // points west and east of it (the same if only one), with the output point longitude in each row frame
+    double y;
+    size_t j[2];
+    double yj[2];
+    double x[2];
+    size_t i[2][2];
+    double xi[2][2];
+};
+
+
+template <typename Stencil>
+void sweep_points(const Grid& Gi, const std::vector<const Grid*>& Go, Stencil&& stencil) {
+    // Calls stencil(output grid, output index, bracket) for each output point inside the input area, by increasing
+    // output index: input and output row latitudes are merged, then the longitudes of each output row and of its
+    // bracketing input rows (the output row rotated to start at the input row), in linear time
+    const auto& Oi      = Gi.offsets();
+    const auto nj       = Gi.Nj();
+    const auto periodic = Gi.area().isPeriodicWestEast();
+
+    struct side_t {
+        bool inside;
+        double x;
+        size_t i[2];
+        double xi[2];
+    };
+
+    std::vector<double> lon;
+    std::vector<side_t> side[2];
+    for (size_t g = 0; g < Go.size(); ++g) {
+        const auto& G = *Go[g];
+        const auto& Oo = G.offsets();
+
+        size_t n = 0;  // input rows north of (or at) the output row
+        for (size_t jo = 0; jo < G.Nj(); ++jo) {
+            const auto y = G.pointXj(jo);
+            while (n < nj && Gi.pointXj(n) >= y) {
+                ++n;
+            }
+            if (y > Gi.area().N() || y < Gi.area().S()) {
+                continue;
+            }
+
+            bracket_t b;
+            b.y    = y;
+            b.j[0] = n == 0 ? 0 : n - 1;
+            b.j[1] = n == nj ? nj - 1 : n;
+
+            const auto no = G.Ni(jo);
+            for (size_t r = 0; r < 2; ++r) {
+                const auto ji = b.j[r];
+                const auto ni = Gi.Ni(ji);
+                b.yj[r]       = Gi.pointXj(ji);
+
+                // output longitudes from the input row first point (periodic) or west limit, rotated to ascending
+                lon.resize(no);
+                for (size_t i = 0; i < no; ++i) {
+                    lon[i] = G.pointXi(jo, i);
+                }
+                const auto west = periodic ? Gi.pointXi(ji, 0) : Gi.westXi(ji);
+                const auto wrap = rotate_longitudes(lon, west);
+
+                auto& s     = side[r];
+                auto before = [&](long i) { return Gi.pointXi(ji, static_cast<size_t>(i)) <= lon[0]; };
+                auto k      = static_cast<size_t>(bisect(0, static_cast<long>(ni), before));
+                s.resize(no);
+                for (size_t p = 0; p < no; ++p) {
+                    const auto x = lon[p];
+                    while (k < ni && Gi.pointXi(ji, k) <= x) {
+                        ++k;
+                    }
+
+                    auto& t  = s[(p + wrap) % no];
+                    t.inside = periodic || x <= Gi.eastXi(ji);
+                    t.x      = x;
+                    if (periodic && k == ni) {
+                        t.i[0]  = ni - 1;
+                        t.i[1]  = 0;
+                        t.xi[0] = Gi.pointXi(ji, ni - 1);
+                        t.xi[1] = Gi.pointXi(ji, 0) + 360.;
+                        continue;
+                    }
+
+                    t.i[0]  = k == 0 ? 0 : k - 1;
+                    t.i[1]  = k == ni ? ni - 1 : k;
+                    t.xi[0] = Gi.pointXi(ji, t.i[0]);
+                    t.xi[1] = Gi.pointXi(ji, t.i[1]);
+                }
+            }
+
+            for (size_t i = 0; i < no; ++i) {
+                if (!side[0][i].inside || !side[1][i].inside) {
+                    continue;
+                }
+                for (size_t r = 0; r < 2; ++r) {
+                    const auto& t = side[r][i];
+                    b.x[r]        = t.x;
+                    for (size_t e = 0; e < 2; ++e) {
+                        b.i[r][e]  = Oi[b.j[r]] + t.i[e];
+                        b.xi[r][e] = t.xi[e];
+                    }
+                }
+                stencil(g, Oo[jo] + i, b);
+            }
+        }
+    }
+}
+
+
+struct block_t {
+    const void* data;
+    size_t size;  // bytes
+};
+
+
+template <typename T>
+const char* type_name() {
+    static_assert(std::is_same<T, uint32_t>::value || std::is_same<T, uint64_t>::value ||
+                      std::is_same<T, float>::value || std::is_same<T, double>::value,
+                  "type_name: unsupported type");
+    return std::is_same<T, uint32_t>::value   ? "u32"
+           : std::is_same<T, uint64_t>::value ? "u64"
+           : std::is_same<T, float>::value    ? "f32"
+                                              : "f64";
+}
+
+
+template <typename I = size_t, typename T = double>
+struct Matrix {
+    // Compressed sparse row (CSR) weights, rows are output points and columns input points (of index type I), weights
+    // of type T (row pointers are always size_t)
+    using index_type = I;
+    using value_type = T;
+
+    Matrix() = default;
+    Matrix(size_t _Nr, size_t _Nc, std::vector<size_t>&& _ia, std::vector<I>&& _ja, std::vector<T>&& _a) :
+        Nr(_Nr), Nc(_Nc) {
+        assert(_ia.size() == Nr + 1 && _ja.size() == _ia.back() && _a.size() == _ia.back());
+        auto s = std::make_shared<std::tuple<std::vector<size_t>, std::vector<I>, std::vector<T>>>(
+            std::move(_ia), std::move(_ja), std::move(_a));
+        ia      = std::get<0>(*s).data();
+        ja      = std::get<1>(*s).data();
+        a       = std::get<2>(*s).data();
+        storage = std::move(s);
+    }
+
+    size_t nnz() const { return ia == nullptr ? 0 : ia[Nr]; }
+
+    // Store support
+    static std::string layout() { return std::string("csr.") + type_name<I>() + "." + type_name<T>(); }
+    std::array<uint64_t, 4> params() const { return {}; }
+    std::vector<block_t> blocks() const {
+        return {{ia, (Nr + 1) * sizeof(size_t)}, {ja, nnz() * sizeof(I)}, {a, nnz() * sizeof(T)}};
+    }
+    bool attach(const uint64_t*, const std::vector<block_t>& b) {
+        if (b.size() != 3 || b[0].size != (Nr + 1) * sizeof(size_t)) {
+            return false;
+        }
+        ia = static_cast<const size_t*>(b[0].data);
+        ja = static_cast<const I*>(b[1].data);
+        a  = static_cast<const T*>(b[2].data);
+        return b[1].size == nnz() * sizeof(I) && b[2].size == nnz() * sizeof(T);
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const Matrix& W) {
+        return out << "Matrix<" << type_name<I>() << "," << type_name<T>() << ">[Nr=" << W.Nr << ",Nc=" << W.Nc
+                   << ",nnz=" << W.nnz() << "]";
+    }
+
+    size_t Nr        = 0;
+    size_t Nc        = 0;
+    const size_t* ia = nullptr;  // [Nr + 1]
+    const I* ja      = nullptr;  // [nnz]
+    const T* a       = nullptr;  // [nnz]
+
+    std::shared_ptr<const void> storage;  // Note: owns the arrays (heap or shared mapping)
+};
+
+
+struct Coverage {
+    // Output grid-box fractions covered by the input grid (0 outside of it), companion of the weights
+    Coverage() = default;
+    explicit Coverage(std::vector<double>&& _c) : Nr(_c.size()) {
+        auto s  = std::make_shared<std::vector<double>>(std::move(_c));
+        c       = s->data();
+        storage = std::move(s);
+    }
+
+    // Store support
+    static std::string layout() { return "coverage.f64"; }
+    std::array<uint64_t, 4> params() const { return {}; }
+    std::vector<block_t> blocks() const { return {{c, Nr * sizeof(double)}}; }
+    bool attach(const uint64_t*, const std::vector<block_t>& b) {
+        if (b.size() != 1 || b[0].size != Nr * sizeof(double)) {
+            return false;
+        }
+        c = static_cast<const double*>(b[0].data);
+        return true;
+    }
+
+    size_t Nr       = 0;
+    size_t Nc       = 0;        // Note: unused
+    const double* c = nullptr;  // [Nr]
+
+    std::shared_ptr<const void> storage;
+};
+
+
+template <typename I, typename T>
+struct builder_t {
+    // Weights of an output grid from (output index, input index, value) contributions by increasing output row (any
+    // order within a row): rows are sorted, merged and normalised by their sum (kept as covered)
+    struct triplet_t {
+        size_t o;
+        size_t i;
+        double a;
+        bool operator<(const triplet_t& other) const { return o < other.o || (o == other.o && i < other.i); }
+    };
+
+    explicit builder_t(const Grid& G) : Oo(G.offsets()), ia(Oo.back() + 1, 0), covered(Oo.back(), 0.) {}
+
+    void add(size_t o, size_t i, double area) {
+        if (o >= Oo[jo + 1]) {
+            flush();
+            while (o >= Oo[jo + 1]) {
+                ++jo;
+            }
+        }
+        row.push_back({o, i, area});
+    }
+
+    void flush() {
+        std::sort(row.begin(), row.end());
+        for (auto t = row.begin(); t != row.end();) {
+            // Note: the same grid-box may intersect across the periodic boundary
+            const auto first = t;
+            auto last        = t;
+            double sum       = 0.;
+            for (; t != row.end() && t->o == first->o; ++t) {
+                if (last != t && last->i == t->i) {
+                    last->a += t->a;
+                }
+                else if (last != t) {
+                    *(++last) = *t;
+                }
+                sum += t->a;
+            }
+
+            for (auto s = first; s <= last; ++s) {
+                ja.push_back(static_cast<I>(s->i));
+                a.push_back(static_cast<T>(s->a / sum));
+            }
+            ia[first->o + 1]  = static_cast<size_t>(last - first) + 1;
+            covered[first->o] = sum;
+        }
+        row.clear();
+    }
+
+    Matrix<I, T> matrix(size_t Nc) {
+        flush();
+        std::partial_sum(ia.begin(), ia.end(), ia.begin());
+        return {Oo.back(), Nc, std::move(ia), std::move(ja), std::move(a)};
+    }
+
+    const std::vector<size_t>& Oo;
+    size_t jo = 0;
+    std::vector<triplet_t> row;
+    std::vector<size_t> ia;
+    std::vector<I> ja;
+    std::vector<T> a;
+    std::vector<double> covered;
+};
+
+
+template <typename I, typename T>
+std::vector<Matrix<I, T>> matrices(std::vector<builder_t<I, T>>& builders, const Grid& Gi,
+                                   const std::vector<const Grid*>& Go, std::vector<Coverage>* coverage) {
+    // Weights of each output grid from its builder (optionally with the covered fractions)
+    std::vector<Matrix<I, T>> W;
+    for (size_t g = 0; g < Go.size(); ++g) {
+        auto& b = builders[g];
+        W.push_back(b.matrix(Gi.offsets().back()));
+        if (coverage != nullptr) {
+            const auto area = Go[g]->areas();
+            for (size_t o = 0; o < area.size(); ++o) {
+                b.covered[o] = std::min(1., b.covered[o] / area[o]);
+            }
+            coverage->emplace_back(std::move(b.covered));
+        }
+    }
+    return W;
+}
+
+
+template <typename I = size_t, typename T = double>
+std::vector<Matrix<I, T>> weights(const Grid& Gi, const std::vector<const Grid*>& Go,
+                                  std::vector<Coverage>* coverage = nullptr) {
+    // Grid-box intersections are collected per output row, then sorted and normalised by output grid-box covered area
+    // (all output grids in the same sweep, optionally with the covered fractions)
+    std::vector<builder_t<I, T>> builders;
+    for (const auto* G : Go) {
+        builders.emplace_back(*G);
+    }
+
+    sweep(Gi, Go, [&builders](size_t g, size_t o, size_t i, double area) { builders[g].add(o, i, area); });
+
+    return matrices(builders, Gi, Go, coverage);
+}
+
+
+template <typename I = size_t, typename T = double>
+Matrix<I, T> weights(const Grid& Gi, const Grid& Go) {
+    return std::move(weights<I, T>(Gi, {&Go}).front());
+}
+
+
+struct Gradients {
+    // Input grid-box gradients (per degree of latitude and longitude) as centred finite-difference stencils: in
+    // longitude from the neighbours in the row (one-sided at regional row ends), in latitude from the rows north and
+    // south at the same longitude, interpolated linearly (one-sided at the first and last rows)
+    explicit Gradients(const Grid& G) : G_(G), O_(G.offsets()) {}
+
+    // Calls add(input index, coefficient) for the stencil of the latitude gradient at input index i
+    template <typename Add>
+    void lat(size_t i, Add&& add) const {
+        const auto j  = row(i);
+        const auto jn = j > 0 ? j - 1 : j;
+        const auto js = j + 1 < G_.Nj() ? j + 1 : j;
+        if (jn == js) {
+            return;
+        }
+
+        const auto c   = 1. / (G_.pointXj(jn) - G_.pointXj(js));
+        const auto lon = G_.pointXi(j, i - O_[j]);
+        jn == j ? add(i, c) : interpolate(jn, lon, c, add);
+        js == j ? add(i, -c) : interpolate(js, lon, -c, add);
+    }
+
+    // Calls add(input index, coefficient) for the stencil of the longitude gradient at input index i
+    template <typename Add>
+    void lon(size_t i, Add&& add) const {
+        const auto j = row(i);
+        const auto n = G_.Ni(j);
+        const auto k = i - O_[j];
+        if (n < 2) {
+            return;
+        }
+
+        if (G_.area().isPeriodicWestEast()) {
+            const auto c = static_cast<double>(n) / 720.;
+            add(O_[j] + (k + 1) % n, c);
+            add(O_[j] + (k + n - 1) % n, -c);
+            return;
+        }
+
+        const auto kw = k > 0 ? k - 1 : k;
+        const auto ke = k + 1 < n ? k + 1 : k;
+        const auto c  = 1. / (G_.pointXi(j, ke) - G_.pointXi(j, kw));
+        add(O_[j] + ke, c);
+        add(O_[j] + kw, -c);
+    }
+
+private:
+    size_t row(size_t i) const {
+        return static_cast<size_t>(std::upper_bound(O_.begin(), O_.end(), i) - O_.begin()) - 1;
+    }
+
+    // Row j value at longitude lon, by linear interpolation of its points (constant beyond regional row ends)
+    template <typename Add>
+    void interpolate(size_t j, double lon, double c, Add&& add) const {
+        const auto n  = G_.Ni(j);
+        const auto x0 = G_.pointXi(j, 0);
+        if (n < 2) {
+            add(O_[j], c);
+            return;
+        }
+
+        const auto dx = G_.pointXi(j, 1) - x0;
+        auto u        = (G_.area().isPeriodicWestEast() ? normalise_longitude(lon, x0) : lon) - x0;
+        u             = std::max(0., u / dx);
+
+        auto k0 = std::min(static_cast<size_t>(u), n - 1);
+        auto k1 = k0 + 1;
+        if (k1 == n) {
+            k1 = G_.area().isPeriodicWestEast() ? 0 : k0;
+        }
+        const auto t = std::min(u - static_cast<double>(k0), 1.);
+        if (t < 1.) {
+            add(O_[j] + k0, c * (1. - t));
+        }
+        if (t > 0.) {
+            add(O_[j] + k1, c * t);
+        }
+    }
+
+    const Grid& G_;
+    const std::vector<size_t>& O_;
+};
+
+
+template <typename I = size_t, typename T = double>
+std::vector<Matrix<I, T>> weights2(const Grid& Gi, const std::vector<const Grid*>& Go,
+                                   std::vector<Coverage>* coverage = nullptr) {
+    // Second-order: each input value is extrapolated to the intersection centroid by its gradient (Jones, 1999), the
+    // centroids from the sweep and the gradients as input stencils, so the weights are a single matrix (gradient
+    // stencils sum to zero, so rows are normalised by the covered area as first-order weights)
+    const Gradients gradients(Gi);
+
+    std::vector<builder_t<I, T>> builders;
+    for (const auto* G : Go) {
+        builders.emplace_back(*G);
+    }
+
+    for (const auto& t : Overlaps(Gi, Go)) {
+        auto& b = builders[t.g];
+        b.add(t.o, t.i, t.area);
+        gradients.lat(t.i, [&](size_t i, double c) { b.add(t.o, i, t.area * t.dlat * c); });
+        gradients.lon(t.i, [&](size_t i, double c) { b.add(t.o, i, t.area * t.dlon * c); });
+    }
+
+    return matrices(builders, Gi, Go, coverage);
+}
+
+
+template <typename I, typename T, typename Stencil>
+std::vector<Matrix<I, T>> point_weights(const Grid& Gi, const std::vector<const Grid*>& Go,
+                                        std::vector<Coverage>* coverage, Stencil&& stencil) {
+    // Weights from the input points bracketing each output point, by stencil(bracket, add(input index, weight)) (all
+    // output grids in the same sweep, output points outside the input area have none, and are not covered)
+    std::vector<builder_t<I, T>> builders;
+    for (const auto* G : Go) {
+        builders.emplace_back(*G);
+    }
+
+    sweep_points(Gi, Go, [&](size_t g, size_t o, const bracket_t& b) {
+        stencil(b, [&builders, g, o](size_t i, double w) { builders[g].add(o, i, w); });
+    });
+
+    std::vector<Matrix<I, T>> W;
+    for (size_t g = 0; g < Go.size(); ++g) {
+        W.push_back(builders[g].matrix(Gi.offsets().back()));
+        if (coverage != nullptr) {
+            std::vector<double> c(W.back().Nr);
+            for (size_t o = 0; o < c.size(); ++o) {
+                c[o] = W.back().ia[o + 1] > W.back().ia[o] ? 1. : 0.;
+            }
+            coverage->emplace_back(std::move(c));
+        }
+    }
+    return W;
+}
+
+
+template <typename I = size_t, typename T = double>
+std::vector<Matrix<I, T>> nearest(const Grid& Gi, const std::vector<const Grid*>& Go,
+                                  std::vector<Coverage>* coverage = nullptr) {
+    // Nearest-neighbour weights, the closest (by great-circle distance) of the bracketing input points
+    constexpr double d2r = M_PI / 180.;
+
+    return point_weights<I, T>(Gi, Go, coverage, [](const bracket_t& b, auto&& add) {
+        // Note: the largest cosine of the central angle is the closest
+        const auto sy = std::sin(b.y * d2r);
+        const auto cy = std::cos(b.y * d2r);
+
+        auto best = b.i[0][0];
+        auto cmax = -2.;
+        for (size_t r = 0; r < 2; ++r) {
+            const auto s = sy * std::sin(b.yj[r] * d2r);
+            const auto c = cy * std::cos(b.yj[r] * d2r);
+            for (size_t e = 0; e < 2; ++e) {
+                const auto cosine = s + c * std::cos((b.x[r] - b.xi[r][e]) * d2r);
+                if (cosine > cmax) {
+                    cmax = cosine;
+                    best = b.i[r][e];
+                }
+            }
+        }
+        add(best, 1.);
+    });
+}
+
+
+template <typename I = size_t, typename T = double>
+std::vector<Matrix<I, T>> bilinear(const Grid& Gi, const std::vector<const Grid*>& Go,
+                                   std::vector<Coverage>* coverage = nullptr) {
+    // Bilinear weights, linear in latitude between the bracketing rows and in longitude within each (the rows may
+    // have different numbers of points); constant beyond the first and last rows or points of the input area
+    return point_weights<I, T>(Gi, Go, coverage, [](const bracket_t& b, auto&& add) {
+        const auto dy = b.yj[0] - b.yj[1];
+        const auto ty = dy > 0. ? (b.yj[0] - b.y) / dy : 0.;
+        for (size_t r = 0; r < 2; ++r) {
+            const auto dx = b.xi[r][1] - b.xi[r][0];
+            const auto tx = dx > 0. ? (b.x[r] - b.xi[r][0]) / dx : 0.;
+            const auto wy = r == 0 ? 1. - ty : ty;
+            for (size_t e = 0; e < 2; ++e) {
+                const auto w = wy * (e == 0 ? 1. - tx : tx);
+                if (w > 0.) {
+                    add(b.i[r][e], w);
+                }
+            }
+        }
+    });
+}
+
+
+struct OverlapIndex {
+    // Conservative weights of single output grid-boxes without the sweep: the output row by its offset, the input
+    // rows overlapping it and the input grid-boxes overlapping in each by bisection of the edge tables, so
+    // O(log n + overlaps) per query (the same weights as the sweep, up to rounding)
+    OverlapIndex(const Grid& Gi, const Grid& Go) : Gi_(Gi), Go_(Go), Oi_(Gi.offsets()), Oo_(Go.offsets()) {
+        std::vector<midpoint_t> e(Gi.Nj() + 1);
+        auto it = e.begin();
+        Gi.fill_lat_edges(it, 0);
+        for (const auto& m : e) {
+            yi_.push_back(m.x);
+        }
+
+        e.resize(Go.Nj() + 1);
+        it = e.begin();
+        Go.fill_lat_edges(it, 1);
+        for (const auto& m : e) {
+            yo_.push_back(m.x);
+        }
+    }
+
+    size_t output_row(size_t o) const {
+        assert(o < Oo_.back());
+        return static_cast<size_t>(std::upper_bound(Oo_.begin(), Oo_.end(), o) - Oo_.begin()) - 1;
+    }
+
+    // Input rows overlapping output row jo, [first, second)
+    std::pair<size_t, size_t> input_rows(size_t jo) const {
+        const auto N = yo_[jo];
+        const auto S = yo_[jo + 1];
+        const auto n = static_cast<long>(Gi_.Nj());
+        return {static_cast<size_t>(bisect(0, n, [&](long j) { return yi_[static_cast<size_t>(j) + 1] >= N; })),
+                static_cast<size_t>(bisect(0, n, [&](long j) { return yi_[static_cast<size_t>(j)] > S; }))};
+    }
+
+    // Weights of output grid-box o, sorted by input index and normalised by the covered area; returns the covered
+    // fraction
+    double query(size_t o, std::vector<std::pair<size_t, double>>& w) const {
+        const auto jo = output_row(o);
+        return query(o, jo, input_rows(jo), w);
+    }
+
+    // Weights of output grid-box o (in output row jo, overlapping input rows [rows.first, rows.second)), sorted by
+    // input index and normalised by the covered area; returns the covered fraction
+    double query(size_t o, size_t jo, std::pair<size_t, size_t> rows, std::vector<std::pair<size_t, double>>& w) const {
+        constexpr double d2r = M_PI / 180.;
+
+        const auto io = o - Oo_[jo];
+        const auto w0 = Go_.lon_edge(jo, io);
+        const auto e0 = Go_.lon_edge(jo, io + 1);
+        const auto N  = yo_[jo];
+        const auto S  = yo_[jo + 1];
+
+        w.clear();
+        for (auto ji = rows.first; ji < rows.second; ++ji) {
+            const auto dy = std::sin(std::min(N, yi_[ji]) * d2r) - std::sin(std::max(S, yi_[ji + 1]) * d2r);
+            if (!(dy > 0.)) {
+                continue;
+            }
+
+            // Note: the output row shifted to start inside the input row (the same edges as the sweep), which is
+            // repeated one turn eastwards
+            const auto ni    = static_cast<long>(Gi_.Ni(ji));
+            const auto shift = normalise_longitude(Go_.westXi(jo), Gi_.westXi(ji)) - Go_.westXi(jo);
+            const auto west  = Go_.lon_edge(jo, io, shift);
+            const auto east  = Go_.lon_edge(jo, io + 1, shift);
+            for (auto turn : {0., 360.}) {
+                auto edge     = [&](long k) { return Gi_.lon_edge(ji, static_cast<size_t>(k), turn); };
+                const auto k0 = std::max(bisect(0, ni + 1, [&](long k) { return edge(k) <= west; }) - 1, 0L);
+                const auto k1 = std::min(bisect(0, ni + 1, [&](long k) { return edge(k) < east; }), ni);
+                for (auto k = k0; k < k1; ++k) {
+                    const auto dx = std::min(edge(k + 1), east) - std::max(edge(k), west);
+                    if (dx > 0.) {
+                        w.emplace_back(Oi_[ji] + static_cast<size_t>(k), dx * d2r * dy);
+                    }
+                }
+            }
+        }
+
+        // Note: the same grid-box may overlap across the periodic boundary
+        std::sort(w.begin(), w.end());
+        double sum = 0.;
+        size_t n   = 0;
+        for (const auto& p : w) {
+            if (n > 0 && w[n - 1].first == p.first) {
+                w[n - 1].second += p.second;
+            }
+            else {
+                w[n++] = p;
+            }
+            sum += p.second;
+        }
+        w.resize(n);
+        for (auto& p : w) {
+            p.second /= sum;
+        }
+
+        const auto area = (e0 - w0) * d2r * (std::sin(N * d2r) - std::sin(S * d2r));
+        return std::min(1., sum / area);
+    }
+
+    // Weights of the given output grid-boxes (rows in the given order), optionally with their coverage; queries are
+    // answered by increasing output index, so each output row and its input rows are located once
+    template <typename I = size_t, typename T = double>
+    Matrix<I, T> query(const std::vector<size_t>& outputs, Coverage* coverage = nullptr) const {
+        std::vector<size_t> order(outputs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return outputs[a] < outputs[b]; });
+
+        std::vector<std::pair<size_t, double>> entries;  // Note: by increasing output index
+        std::vector<std::pair<size_t, double>> w;
+        std::vector<size_t> start(outputs.size());
+        std::vector<size_t> count(outputs.size());
+        std::vector<double> c(outputs.size());
+
+        auto jo = Go_.Nj();
+        std::pair<size_t, size_t> rows{0, 0};
+        for (auto q : order) {
+            const auto o = outputs[q];
+            if (jo == Go_.Nj() || o < Oo_[jo] || o >= Oo_[jo + 1]) {
+                jo   = output_row(o);
+                rows = input_rows(jo);
+            }
+
+            c[q]     = query(o, jo, rows, w);
+            start[q] = entries.size();
+            count[q] = w.size();
+            entries.insert(entries.end(), w.begin(), w.end());
+        }
+
+        std::vector<size_t> ia(outputs.size() + 1, 0);
+        for (size_t r = 0; r < outputs.size(); ++r) {
+            ia[r + 1] = ia[r] + count[r];
+        }
+
+        std::vector<I> ja(ia.back());
+        std::vector<T> a(ia.back());
+        for (size_t r = 0; r < outputs.size(); ++r) {
+            for (size_t k = 0; k < count[r]; ++k) {
+                ja[ia[r] + k] = static_cast<I>(entries[start[r] + k].first);
+                a[ia[r] + k]  = static_cast<T>(entries[start[r] + k].second);
+            }
+        }
+
+        if (coverage != nullptr) {
+            *coverage = Coverage(std::move(c));
+        }
+        return {outputs.size(), Oi_.back(), std::move(ia), std::move(ja), std::move(a)};
+    }
+
+private:
+    const Grid& Gi_;
+    const Grid& Go_;
+    const std::vector<size_t>& Oi_;
+    const std::vector<size_t>& Oo_;
+    std::vector<double> yi_;  // latitude edges (descending)
+    std::vector<double> yo_;
+};
+
+
+template <typename I, typename T>
+Matrix<I, T> compose(const Matrix<I, T>& B, const Matrix<I, T>& A) {
+    // Weights of remapping by A then B (sparse matrix-matrix product B * A), by rows of B in parallel: each row
+    // gathers the rows of A it refers to, sorted by column and merged (accumulated in double, in the same order
+    // regardless of the number of threads)
+    assert(B.Nc == A.Nr);
+
+    struct chunk_t {
+        std::vector<size_t> n;
+        std::vector<I> ja;
+        std::vector<T> a;
+    };
+
+    std::vector<chunk_t> chunks(threads());
+    parallel_for(B.Nr, [&](size_t c, size_t begin, size_t end) {
+        auto& chunk = chunks[c];
+        chunk.n.assign(end - begin, 0);
+
+        std::vector<std::pair<I, double>> row;
+        for (size_t r = begin; r < end; ++r) {
+            row.clear();
+            for (auto p = B.ia[r]; p < B.ia[r + 1]; ++p) {
+                const auto k = static_cast<size_t>(B.ja[p]);
+                const auto b = static_cast<double>(B.a[p]);
+                for (auto q = A.ia[k]; q < A.ia[k + 1]; ++q) {
+                    row.emplace_back(A.ja[q], b * static_cast<double>(A.a[q]));
+                }
+            }
+
+            using entry_t = std::pair<I, double>;
+            std::stable_sort(row.begin(), row.end(),
+                             [](const entry_t& x, const entry_t& y) { return x.first < y.first; });
+
+            for (auto t = row.begin(); t != row.end();) {
+                const auto col = t->first;
+                double sum     = 0.;
+                for (; t != row.end() && t->first == col; ++t) {
+                    sum += t->second;
+                }
+                chunk.ja.push_back(col);
+                chunk.a.push_back(static_cast<T>(sum));
+                ++chunk.n[r - begin];
+            }
+        }
+    });
+
+    std::vector<size_t> ia(B.Nr + 1, 0);
+    std::vector<size_t> start(chunks.size() + 1, 0);
+    for (size_t c = 0, r = 0; c < chunks.size(); ++c) {
+        for (auto n : chunks[c].n) {
+            ia[r + 1] = ia[r] + n;
+            ++r;
+        }
+        start[c + 1] = start[c] + chunks[c].ja.size();
+    }
+
+    std::vector<I> ja(ia.back());
+    std::vector<T> a(ia.back());
+    parallel_for(chunks.size(), [&](size_t, size_t begin, size_t end) {
+        for (auto c = begin; c < end; ++c) {
+            std::copy(chunks[c].ja.begin(), chunks[c].ja.end(), ja.begin() + static_cast<std::ptrdiff_t>(start[c]));
+            std::copy(chunks[c].a.begin(), chunks[c].a.end(), a.begin() + static_cast<std::ptrdiff_t>(start[c]));
+        }
+    });
+
+    return {B.Nr, A.Nc, std::move(ia), std::move(ja), std::move(a)};
+}
+
+template <typename I, typename T>
+void column_bands(const Matrix<I, T>& W, std::vector<I>& hi, std::vector<I>& lo) {
+    // Running maximum (hi) and minimum (lo, from the last row) columns of the rows, so the rows that can refer to
+    // columns [begin, end) are [lower_bound(hi, begin), lower_bound(lo, end))
+    // Note: rows of weights from a sweep refer to increasing input rows, so these are narrow bands
+    hi.resize(W.Nr);
+    lo.resize(W.Nr);
+    I running = 0;
+    for (size_t r = 0; r < W.Nr; ++r) {
+        running = W.ia[r] < W.ia[r + 1] ? std::max(running, W.ja[W.ia[r + 1] - 1]) : running;
+        hi[r]   = running;  // Note: columns are sorted within rows
+    }
+    running = std::numeric_limits<I>::max();
+    for (auto r = W.Nr; r > 0; --r) {
+        running   = W.ia[r - 1] < W.ia[r] ? std::min(running, W.ja[W.ia[r - 1]]) : running;
+        lo[r - 1] = running;
+    }
+}
+
+
+template <typename I, typename T>
+Matrix<I, T> transpose(const Matrix<I, T>& W) {
+    // Adjoint weights (rows are input points, columns output points), in parallel: columns of W are partitioned in
+    // contiguous ranges, one per thread, each visiting only the rows that can refer to its range (as apply_transpose)
+    // to count, then scatter its entries (one counter per column in all); rows of the transpose keep the order of W
+    // rows (the same regardless of the number of threads)
+    std::vector<I> hi;
+    std::vector<I> lo;
+    column_bands(W, hi, lo);
+
+    auto rows = [&hi, &lo](size_t begin, size_t end) {
+        return std::make_pair(static_cast<size_t>(std::lower_bound(hi.begin(), hi.end(), begin) - hi.begin()),
+                              static_cast<size_t>(std::lower_bound(lo.begin(), lo.end(), end) - lo.begin()));
+    };
+
+    std::vector<size_t> ia(W.Nc + 1, 0);
+    parallel_for(W.Nc, [&](size_t, size_t begin, size_t end) {
+        const auto [rb, re] = rows(begin, end);
+        for (auto r = rb; r < re; ++r) {
+            for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+                const auto col = static_cast<size_t>(W.ja[k]);
+                if (begin <= col && col < end) {
+                    ++ia[col + 1];
+                }
+            }
+        }
+    });
+    std::partial_sum(ia.begin(), ia.end(), ia.begin());
+
+    std::vector<I> ja(W.nnz());
+    std::vector<T> a(W.nnz());
+    parallel_for(W.Nc, [&](size_t, size_t begin, size_t end) {
+        const auto [rb, re] = rows(begin, end);
+        std::vector<size_t> pos(ia.begin() + static_cast<std::ptrdiff_t>(begin),
+                                ia.begin() + static_cast<std::ptrdiff_t>(end));
+        for (auto r = rb; r < re; ++r) {
+            for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+                const auto col = static_cast<size_t>(W.ja[k]);
+                if (begin <= col && col < end) {
+                    const auto p = pos[col - begin]++;
+                    ja[p]        = static_cast<I>(r);
+                    a[p]         = W.a[k];
+                }
+            }
+        }
+    });
+
+    return {W.Nc, W.Nr, std::move(ia), std::move(ja), std::move(a)};
+}
+
+template <typename I, typename T>
+Matrix<I, T> extract_rows(const Matrix<I, T>& W, const std::vector<size_t>& rows) {
+    // Weights of the given rows (such as a regional output of global weights), O(their number of non-zeros)
+    std::vector<size_t> ia(rows.size() + 1, 0);
+    for (size_t r = 0; r < rows.size(); ++r) {
+        assert(rows[r] < W.Nr);
+        ia[r + 1] = ia[r] + W.ia[rows[r] + 1] - W.ia[rows[r]];
+    }
+
+    std::vector<I> ja(ia.back());
+    std::vector<T> a(ia.back());
+    for (size_t r = 0; r < rows.size(); ++r) {
+        const auto first = static_cast<std::ptrdiff_t>(W.ia[rows[r]]);
+        const auto last  = static_cast<std::ptrdiff_t>(W.ia[rows[r] + 1]);
+        std::copy(W.ja + first, W.ja + last, ja.begin() + static_cast<std::ptrdiff_t>(ia[r]));
+        std::copy(W.a + first, W.a + last, a.begin() + static_cast<std::ptrdiff_t>(ia[r]));
+    }
+
+    return {rows.size(), W.Nc, std::move(ia), std::move(ja), std::move(a)};
+}
+
+
+Coverage extract_rows(const Coverage& C, const std::vector<size_t>& rows) {
+    std::vector<double> c(rows.size());
+    for (size_t r = 0; r < rows.size(); ++r) {
+        c[r] = C.c[rows[r]];
+    }
+    return Coverage(std::move(c));
+}
+
+
+template <typename I, typename T>
+Matrix<I, T> prune(const Matrix<I, T>& W, double threshold) {
+    // Weights without those smaller (in absolute value) than threshold relative to their row, rescaled so rows keep
+    // their sum (rows whose remaining weights sum to zero are kept whole)
+    std::vector<size_t> ia(W.Nr + 1, 0);
+    std::vector<I> ja;
+    std::vector<T> a;
+    for (size_t r = 0; r < W.Nr; ++r) {
+        double sum  = 0.;
+        double norm = 0.;
+        for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+            sum += static_cast<double>(W.a[k]);
+            norm += std::abs(static_cast<double>(W.a[k]));
+        }
+
+        double kept = 0.;
+        for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+            kept += std::abs(static_cast<double>(W.a[k])) < threshold * norm ? 0. : static_cast<double>(W.a[k]);
+        }
+
+        const auto whole = kept == 0.;
+        const auto scale = whole ? 1. : sum / kept;
+        for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+            if (whole || !(std::abs(static_cast<double>(W.a[k])) < threshold * norm)) {
+                ja.push_back(W.ja[k]);
+                a.push_back(static_cast<T>(static_cast<double>(W.a[k]) * scale));
+            }
+        }
+        ia[r + 1] = ja.size();
+    }
+
+    return {W.Nr, W.Nc, std::move(ia), std::move(ja), std::move(a)};
+}
+
+
+bool nested(const Grid& fine, const Grid& coarse) {
+    // Whether all coarse grid-box edges are fine grid-box edges (then each fine grid-box is in a single coarse
+    // grid-box, and remapping through the fine grid is the same as remapping directly)
+    constexpr double eps = 1e-9;
+
+    auto find = [](const std::vector<midpoint_t>& M, double x, bool descending) {
+        auto it = descending ? std::lower_bound(M.begin(), M.end(), x + eps,
+                                                [](const midpoint_t& m, double v) { return m.x > v; })
+                             : std::lower_bound(M.begin(), M.end(), x - eps,
+                                                [](const midpoint_t& m, double v) { return m.x < v; });
+        return it != M.end() && std::abs(it->x - x) <= eps;
+    };
+
+    std::vector<midpoint_t> Fj(fine.Nj() + 1);
+    std::vector<midpoint_t> Cj(coarse.Nj() + 1);
+    auto it = Fj.begin();
+    fine.fill_lat_edges(it, 0);
+    it = Cj.begin();
+    coarse.fill_lat_edges(it, 1);
+
+    for (const auto& e : Cj) {
+        if (e.x < Fj.front().x - eps && e.x > Fj.back().x + eps && !find(Fj, e.x, true)) {
+            return false;
+        }
+    }
+
+    // Longitude edges, per fine row (in a single coarse row) and within the fine row limits
+    std::vector<midpoint_t> Fi;
+    std::vector<midpoint_t> Ci;
+    std::vector<double> ci;
+    for (size_t jf = 0; jf < fine.Nj(); ++jf) {
+        const auto mid = 0.5 * (Fj[jf].x + Fj[jf + 1].x);
+        const auto jc  = static_cast<size_t>(
+            std::lower_bound(Cj.begin(), Cj.end(), mid, [](const midpoint_t& m, double v) { return m.x > v; }) -
+            Cj.begin());
+        if (jc == 0 || jc > coarse.Nj()) {
+            continue;
+        }
+
+        Fi.resize(fine.Ni(jf) + 1);
+        it = Fi.begin();
+        fine.fill_lon_edges(it, jf, 0);
+
+        Ci.resize(coarse.Ni(jc - 1) + 1);
+        it = Ci.begin();
+        coarse.fill_lon_edges(it, jc - 1, 1);
+
+        // Coarse edges rotated to start at the fine row west (a periodic row drops its last edge, the first one turn
+        // later), then matched in one pass
+        ci.clear();
+        for (const auto& e : Ci) {
+            ci.push_back(e.x);
+        }
+        if (coarse.area().isPeriodicWestEast()) {
+            ci.pop_back();
+        }
+
+        const auto W = Fi.front().x;
+        const auto E = Fi.back().x;
+        rotate_longitudes(ci, W - eps);
+
+        auto f = Fi.begin();
+        for (auto x : ci) {
+            if (x <= W + eps || x >= E - eps) {
+                continue;
+            }
+            while (f != Fi.end() && f->x < x - eps) {
+                ++f;
+            }
+            if (f == Fi.end() || f->x > x + eps) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+template <typename F>
+void remap(const Grid& Gi, const std::vector<const Grid*>& Go, const F* x, const std::vector<F*>& y,
+           size_t nfields = 1, std::vector<Coverage>* coverage = nullptr) {
+    // Matrix-free: grid-box intersections are accumulated into the output fields during the sweep (weights are never
+    // stored), then normalised by output grid-box covered area; fields are stored one after the other
+    const auto Ni = Gi.offsets().back();
+
+    std::vector<size_t> No;
+    std::vector<std::vector<double>> sum;
+    std::vector<std::vector<double>> covered;
+    for (const auto* G : Go) {
+        No.push_back(G->offsets().back());
+        sum.emplace_back(nfields * No.back(), 0.);
+        covered.emplace_back(No.back(), 0.);
+    }
+
+    sweep(Gi, Go, [&](size_t g, size_t o, size_t i, double area) {
+        covered[g][o] += area;
+        for (size_t f = 0; f < nfields; ++f) {
+            sum[g][f * No[g] + o] += area * static_cast<double>(x[f * Ni + i]);
+        }
+    });
+
+    for (size_t g = 0; g < Go.size(); ++g) {
+        for (size_t f = 0; f < nfields; ++f) {
+            for (size_t o = 0; o < No[g]; ++o) {
+                const auto c        = covered[g][o];
+                y[g][f * No[g] + o] = c > 0. ? static_cast<F>(sum[g][f * No[g] + o] / c) : F(0);
+            }
+        }
+
+        if (coverage != nullptr) {
+            const auto area = Go[g]->areas();
+            for (size_t o = 0; o < No[g]; ++o) {
+                covered[g][o] = std::min(1., covered[g][o] / area[o]);
+            }
+            coverage->emplace_back(std::move(covered[g]));
+        }
+    }
+}
+
+
+template <typename F>
+void remap(const Grid& Gi, const Grid& Go, const F* x, F* y, size_t nfields = 1) {
+    remap(Gi, {&Go}, x, std::vector<F*>{y}, nfields);
+}
+
+
+constexpr size_t FIELDS_BLOCK = 8;
+
+
+template <typename I, typename T, typename F>
+void apply(const Matrix<I, T>& W, const F* x, F* y, size_t nfields = 1) {
+    // Fields are stored one after the other; each weight is loaded once per block of fields, accumulated in double
+    for (size_t f = 0; f < nfields; f += FIELDS_BLOCK) {
+        const auto nb = std::min(FIELDS_BLOCK, nfields - f);
+        const auto* xf = x + f * W.Nc;
+        auto* yf       = y + f * W.Nr;
+
+        for (size_t r = 0; r < W.Nr; ++r) {
+            double sum[FIELDS_BLOCK] = {};
+            for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+                const auto w   = static_cast<double>(W.a[k]);
+                const auto* xk = xf + W.ja[k];
+                for (size_t b = 0; b < nb; ++b) {
+                    sum[b] += w * static_cast<double>(xk[b * W.Nc]);
+                }
+            }
+            for (size_t b = 0; b < nb; ++b) {
+                yf[b * W.Nr + r] = static_cast<F>(sum[b]);
+            }
+        }
+    }
+}
+
+
+template <typename I, typename T, typename F>
+void apply_transpose(const Matrix<I, T>& W, const F* x, F* y, size_t nfields = 1) {
+    // Adjoint (x has W.Nr points, y has W.Nc), without atomics: input points are partitioned in contiguous ranges, one
+    // per thread, each visiting only the rows that can refer to its range (bounded by the running maximum and minimum
+    // columns of the rows) and accumulating by increasing row (the same regardless of the number of threads)
+    std::vector<I> hi;
+    std::vector<I> lo;
+    column_bands(W, hi, lo);
+
+    parallel_for(W.Nc, [&](size_t, size_t begin, size_t end) {
+        const auto n  = end - begin;
+        const auto rb = static_cast<size_t>(std::lower_bound(hi.begin(), hi.end(), begin) - hi.begin());
+        const auto re = static_cast<size_t>(std::lower_bound(lo.begin(), lo.end(), end) - lo.begin());
+
+        std::vector<double> sum(n * nfields, 0.);
+        for (auto r = rb; r < re; ++r) {
+            for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+                const auto col = static_cast<size_t>(W.ja[k]);
+                if (begin <= col && col < end) {
+                    const auto w = static_cast<double>(W.a[k]);
+                    for (size_t f = 0; f < nfields; ++f) {
+                        sum[f * n + col - begin] += w * static_cast<double>(x[f * W.Nr + r]);
+                    }
+                }
+            }
+        }
+
+        for (size_t f = 0; f < nfields; ++f) {
+            for (auto col = begin; col < end; ++col) {
+                y[f * W.Nc + col] = static_cast<F>(sum[f * n + col - begin]);
+            }
+        }
+    });
+}
+
+
+template <typename I = size_t, typename T = double>
+struct SellMatrix {
+    // Sliced ELLPACK (SELL-C-sigma) weights: rows are sorted by decreasing length within windows of sigma rows, and
+    // grouped in slices of C rows stored column-major, padded to the slice longest row (with zero weights of the row
+    // last column, so a non-finite input value reaches the same outputs as in CSR); empty rows are marked as padding,
+    // their outputs are zero as in CSR
+    using index_type = I;
+    using value_type = T;
+
+    static constexpr size_t C = 8;
+
+    SellMatrix() = default;
+    explicit SellMatrix(const Matrix<I, T>& W, size_t _sigma = 32 * C) :
+        Nr(W.Nr), Nc(W.Nc), sigma(_sigma), Ns((W.Nr + C - 1) / C) {
+        assert(sigma > 0 && sigma % C == 0);
+
+        auto len = [&W](size_t r) { return W.ia[r + 1] - W.ia[r]; };
+
+        std::vector<I> _perm(Ns * C, static_cast<I>(Nr));  // Note: Nr marks padding rows
+        std::iota(_perm.begin(), _perm.begin() + static_cast<std::ptrdiff_t>(Nr), 0);
+        for (size_t r = 0; r < Nr; r += sigma) {
+            std::stable_sort(_perm.begin() + static_cast<std::ptrdiff_t>(r),
+                             _perm.begin() + static_cast<std::ptrdiff_t>(std::min(r + sigma, Nr)),
+                             [&len](I a, I b) { return len(a) > len(b); });
+        }
+
+        std::vector<size_t> _sp(Ns + 1, 0);
+        for (size_t s = 0; s < Ns; ++s) {
+            _sp[s + 1] = _sp[s] + C * len(_perm[s * C]);  // Note: slice first row is its longest
+        }
+        for (auto& r : _perm) {
+            r = r < Nr && len(r) == 0 ? static_cast<I>(Nr) : r;
+        }
+
+        std::vector<I> _col(_sp[Ns], 0);
+        std::vector<T> _val(_sp[Ns], 0);
+        for (size_t s = 0; s < Ns; ++s) {
+            for (size_t l = 0; l < C; ++l) {
+                const auto r = _perm[s * C + l];
+                if (r == Nr) {
+                    continue;
+                }
+                for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+                    _col[_sp[s] + (k - W.ia[r]) * C + l] = W.ja[k];
+                    _val[_sp[s] + (k - W.ia[r]) * C + l] = W.a[k];
+                }
+                for (auto k = len(r); _sp[s] + k * C < _sp[s + 1]; ++k) {
+                    _col[_sp[s] + k * C + l] = W.ja[W.ia[r + 1] - 1];
+                }
+            }
+        }
+
+        auto st = std::make_shared<std::tuple<std::vector<I>, std::vector<size_t>, std::vector<I>, std::vector<T>>>(
+            std::move(_perm), std::move(_sp), std::move(_col), std::move(_val));
+        perm    = std::get<0>(*st).data();
+        sp      = std::get<1>(*st).data();
+        col     = std::get<2>(*st).data();
+        val     = std::get<3>(*st).data();
+        storage = std::move(st);
+    }
+
+    size_t nnz() const { return sp == nullptr ? 0 : sp[Ns]; }  // Note: including padding
+
+    // Store support
+    static std::string layout() { return std::string("sell.") + type_name<I>() + "." + type_name<T>(); }
+    std::array<uint64_t, 4> params() const { return {C, sigma, Ns, 0}; }
+    std::vector<block_t> blocks() const {
+        return {{perm, Ns * C * sizeof(I)},
+                {sp, (Ns + 1) * sizeof(size_t)},
+                {col, nnz() * sizeof(I)},
+                {val, nnz() * sizeof(T)}};
+    }
+    bool attach(const uint64_t* p, const std::vector<block_t>& b) {
+        if (p[0] != C || p[2] != (Nr + C - 1) / C || b.size() != 4 || b[0].size != p[2] * C * sizeof(I) ||
+            b[1].size != (p[2] + 1) * sizeof(size_t)) {
+            return false;
+        }
+        sigma = p[1];
+        Ns    = p[2];
+        perm  = static_cast<const I*>(b[0].data);
+        sp    = static_cast<const size_t*>(b[1].data);
+        col   = static_cast<const I*>(b[2].data);
+        val   = static_cast<const T*>(b[3].data);
+        return b[2].size == nnz() * sizeof(I) && b[3].size == nnz() * sizeof(T);
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const SellMatrix& W) {
+        return out << "SellMatrix<" << type_name<I>() << "," << type_name<T>() << ">[Nr=" << W.Nr << ",Nc=" << W.Nc
+                   << ",C=" << C << ",sigma=" << W.sigma << ",nnz=" << W.nnz() << "]";
+    }
+
+    size_t Nr    = 0;
+    size_t Nc    = 0;
+    size_t sigma = 0;
+    size_t Ns    = 0;  // slices
+
+    const I* perm    = nullptr;  // [Ns * C] slice row to matrix row (Nr if padding or empty)
+    const size_t* sp = nullptr;  // [Ns + 1] slice starting entries
+    const I* col     = nullptr;  // [nnz]
+    const T* val     = nullptr;  // [nnz]
+
+    std::shared_ptr<const void> storage;
+};
+
+
+template <size_t C, typename I, typename T, typename F>
+void apply_slice(const I* col, const T* val, size_t n, const F* x, double* sum) {
+    // One SELL slice (n entries, column-major), sum[C] must be 64-byte aligned
+    static_assert(C == 8, "SELL apply kernels assume C = 8");
+#if defined(__AVX512F__)
+    // Note: 32-bit indices are zero-extended (gathers take signed indices), masked variants avoid spurious warnings
+    auto acc = _mm512_setzero_pd();
+    for (size_t k = 0; k < n; k += C) {
+        __m512i idx;
+        __m512d vk;
+        if constexpr (sizeof(I) == 4) {
+            idx = _mm512_maskz_cvtepu32_epi64(0xff, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(col + k)));
+        }
+        else {
+            idx = _mm512_loadu_si512(col + k);
+        }
+        if constexpr (std::is_same<T, float>::value) {
+            vk = _mm512_maskz_cvtps_pd(0xff, _mm256_loadu_ps(val + k));
+        }
+        else {
+            vk = _mm512_loadu_pd(val + k);
+        }
+        __m512d xk;
+        if constexpr (std::is_same<F, float>::value) {
+            auto xs = _mm512_mask_i64gather_ps(_mm256_setzero_ps(), 0xff, idx, x, sizeof(float));
+            xk      = _mm512_maskz_cvtps_pd(0xff, xs);
+        }
+        else {
+            xk = _mm512_mask_i64gather_pd(_mm512_setzero_pd(), 0xff, idx, x, sizeof(double));
+        }
+        acc = _mm512_fmadd_pd(vk, xk, acc);
+    }
+    _mm512_store_pd(sum, acc);
+#elif defined(__AVX2__)
+    auto acc0 = _mm256_setzero_pd();
+    auto acc1 = _mm256_setzero_pd();
+    for (size_t k = 0; k < n; k += C) {
+        __m256i i0, i1;
+        __m256d v0, v1;
+        if constexpr (sizeof(I) == 4) {
+            auto* idx = reinterpret_cast<const __m128i*>(col + k);
+            i0        = _mm256_cvtepu32_epi64(_mm_loadu_si128(idx));
+            i1        = _mm256_cvtepu32_epi64(_mm_loadu_si128(idx + 1));
+        }
+        else {
+            auto* idx = reinterpret_cast<const __m256i*>(col + k);
+            i0        = _mm256_loadu_si256(idx);
+            i1        = _mm256_loadu_si256(idx + 1);
+        }
+        if constexpr (std::is_same<T, float>::value) {
+            v0 = _mm256_cvtps_pd(_mm_loadu_ps(val + k));
+            v1 = _mm256_cvtps_pd(_mm_loadu_ps(val + k + 4));
+        }
+        else {
+            v0 = _mm256_loadu_pd(val + k);
+            v1 = _mm256_loadu_pd(val + k + 4);
+        }
+        __m256d x0, x1;
+        if constexpr (std::is_same<F, float>::value) {
+            x0 = _mm256_cvtps_pd(_mm256_i64gather_ps(x, i0, sizeof(float)));
+            x1 = _mm256_cvtps_pd(_mm256_i64gather_ps(x, i1, sizeof(float)));
+        }
+        else {
+            x0 = _mm256_i64gather_pd(x, i0, sizeof(double));
+            x1 = _mm256_i64gather_pd(x, i1, sizeof(double));
+        }
+#if defined(__FMA__)
+        acc0 = _mm256_fmadd_pd(v0, x0, acc0);
+        acc1 = _mm256_fmadd_pd(v1, x1, acc1);
+#else
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(v0, x0));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(v1, x1));
+#endif
+    }
+    _mm256_store_pd(sum, acc0);
+    _mm256_store_pd(sum + 4, acc1);
+#else
+    std::fill_n(sum, C, 0.);
+    for (size_t k = 0; k < n; k += C) {
+        for (size_t l = 0; l < C; ++l) {
+            sum[l] += static_cast<double>(val[k + l]) * static_cast<double>(x[col[k + l]]);
+        }
+    }
+#endif
+}
+
+
+template <typename I, typename T, typename F>
+void apply(const SellMatrix<I, T>& W, const F* x, F* y, size_t nfields = 1) {
+    // Fields are processed slice by slice, so the slice indices and weights are reloaded from cache; empty rows (not in
+    // any slice) are zero
+    constexpr auto C = SellMatrix<I, T>::C;
+    std::fill(y, y + nfields * W.Nr, F(0));
+
+    for (size_t s = 0; s < W.Ns; ++s) {
+        for (size_t f = 0; f < nfields; ++f) {
+            alignas(64) double sum[C];
+            apply_slice<C>(W.col + W.sp[s], W.val + W.sp[s], W.sp[s + 1] - W.sp[s], x + f * W.Nc, sum);
+
+            for (size_t l = 0; l < C; ++l) {
+                if (W.perm[s * C + l] < W.Nr) {
+                    y[f * W.Nr + W.perm[s * C + l]] = static_cast<F>(sum[l]);
+                }
+            }
+        }
+    }
+}
+
+
+template <typename I = size_t, typename T = double>
+struct RunMatrix {
+    // Run-length column ranges: each row columns are stored as runs of consecutive columns (start, length), as the
+    // input grid-boxes intersecting an output grid-box are contiguous in each input row; weights are stored as in CSR
+    using index_type = I;
+    using value_type = T;
+
+    RunMatrix() = default;
+    explicit RunMatrix(const Matrix<I, T>& W) : Nr(W.Nr), Nc(W.Nc) {
+        std::vector<size_t> _rp(Nr + 1, 0);
+        std::vector<I> _rs;
+        std::vector<I> _rl;
+        for (size_t r = 0; r < Nr; ++r) {
+            for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+                if (k > W.ia[r] && W.ja[k] == W.ja[k - 1] + 1) {
+                    ++_rl.back();
+                    continue;
+                }
+                _rs.push_back(W.ja[k]);
+                _rl.push_back(1);
+            }
+            _rp[r + 1] = _rs.size();
+        }
+
+        std::vector<T> _a(W.a, W.a + W.nnz());
+
+        auto st = std::make_shared<std::tuple<std::vector<size_t>, std::vector<I>, std::vector<I>, std::vector<T>>>(
+            std::move(_rp), std::move(_rs), std::move(_rl), std::move(_a));
+        rp      = std::get<0>(*st).data();
+        rs      = std::get<1>(*st).data();
+        rl      = std::get<2>(*st).data();
+        a       = std::get<3>(*st).data();
+        nnz_    = std::get<3>(*st).size();
+        storage = std::move(st);
+    }
+
+    size_t runs() const { return rp == nullptr ? 0 : rp[Nr]; }
+    size_t nnz() const { return nnz_; }
+
+    // Store support
+    static std::string layout() { return std::string("runs.") + type_name<I>() + "." + type_name<T>(); }
+    std::array<uint64_t, 4> params() const { return {nnz_, 0, 0, 0}; }
+    std::vector<block_t> blocks() const {
+        return {{rp, (Nr + 1) * sizeof(size_t)},
+                {rs, runs() * sizeof(I)},
+                {rl, runs() * sizeof(I)},
+                {a, nnz_ * sizeof(T)}};
+    }
+    bool attach(const uint64_t* p, const std::vector<block_t>& b) {
+        if (b.size() != 4 || b[0].size != (Nr + 1) * sizeof(size_t)) {
+            return false;
+        }
+        nnz_ = p[0];
+        rp   = static_cast<const size_t*>(b[0].data);
+        rs   = static_cast<const I*>(b[1].data);
+        rl   = static_cast<const I*>(b[2].data);
+        a    = static_cast<const T*>(b[3].data);
+        return b[1].size == runs() * sizeof(I) && b[2].size == runs() * sizeof(I) && b[3].size == nnz_ * sizeof(T);
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const RunMatrix& W) {
+        return out << "RunMatrix<" << type_name<I>() << "," << type_name<T>() << ">[Nr=" << W.Nr << ",Nc=" << W.Nc
+                   << ",nnz=" << W.nnz() << ",runs=" << W.runs() << "]";
+    }
+
+    size_t Nr = 0;
+    size_t Nc = 0;
+
+    const size_t* rp = nullptr;  // [Nr + 1] row starting runs
+    const I* rs      = nullptr;  // [runs] run starting column
+    const I* rl      = nullptr;  // [runs] run length
+    const T* a       = nullptr;  // [nnz]
+
+    std::shared_ptr<const void> storage;
+
+private:
+    size_t nnz_ = 0;
+};
+
+
+template <typename I, typename T, typename F>
+void apply(const RunMatrix<I, T>& W, const F* x, F* y, size_t nfields = 1) {
+    // Fields are stored one after the other; each weight is loaded once per block of fields, accumulated in double
+    for (size_t f = 0; f < nfields; f += FIELDS_BLOCK) {
+        const auto nb = std::min(FIELDS_BLOCK, nfields - f);
+        const auto* xf = x + f * W.Nc;
+        auto* yf       = y + f * W.Nr;
+
+        const auto* a = W.a;
+        for (size_t r = 0; r < W.Nr; ++r) {
+            double sum[FIELDS_BLOCK] = {};
+            for (auto k = W.rp[r]; k < W.rp[r + 1]; ++k) {
+                const auto* xk = xf + W.rs[k];
+                for (size_t l = 0; l < W.rl[k]; ++l) {
+                    const auto w = static_cast<double>(a[l]);
+                    for (size_t b = 0; b < nb; ++b) {
+                        sum[b] += w * static_cast<double>(xk[b * W.Nc + l]);
+                    }
+                }
+                a += W.rl[k];
+            }
+            for (size_t b = 0; b < nb; ++b) {
+                yf[b * W.Nr + r] = static_cast<F>(sum[b]);
+            }
+        }
+    }
+}
+
+
+template <typename I, typename T, typename F>
+void apply_interleaved(const Matrix<I, T>& W, const F* x, F* y, size_t nfields) {
+    // Fields are interleaved (point-major, field-minor): each weight is loaded once for all fields, contiguously
+    std::vector<double> sum(nfields);
+    for (size_t r = 0; r < W.Nr; ++r) {
+        std::fill(sum.begin(), sum.end(), 0.);
+        for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+            const auto w   = static_cast<double>(W.a[k]);
+            const auto* xk = x + W.ja[k] * nfields;
+            for (size_t f = 0; f < nfields; ++f) {
+                sum[f] += w * static_cast<double>(xk[f]);
+            }
+        }
+        std::transform(sum.begin(), sum.end(), y + r * nfields, [](double s) { return static_cast<F>(s); });
+    }
+}
+
+
+template <typename I, typename T, typename F>
+void apply_interleaved(const RunMatrix<I, T>& W, const F* x, F* y, size_t nfields) {
+    // Fields are interleaved (point-major, field-minor): each run reads a contiguous block of run length * fields
+    std::vector<double> sum(nfields);
+    const auto* a = W.a;
+    for (size_t r = 0; r < W.Nr; ++r) {
+        std::fill(sum.begin(), sum.end(), 0.);
+        for (auto k = W.rp[r]; k < W.rp[r + 1]; ++k) {
+            const auto* xk = x + W.rs[k] * nfields;
+            for (size_t l = 0; l < W.rl[k]; ++l, xk += nfields) {
+                const auto w = static_cast<double>(a[l]);
+                for (size_t f = 0; f < nfields; ++f) {
+                    sum[f] += w * static_cast<double>(xk[f]);
+                }
+            }
+            a += W.rl[k];
+        }
+        std::transform(sum.begin(), sum.end(), y + r * nfields, [](double s) { return static_cast<F>(s); });
+    }
+}
+
+
+template <typename F>
+std::vector<uint64_t> validity(const F* x, size_t size, size_t nfields, F missing) {
+    // Validity bitmasks (bit set for valid values) of fields one after the other, each ceil(size / 64) words
+    const auto words = (size + 63) / 64;
+    std::vector<uint64_t> mask(nfields * words, 0);
+    for (size_t f = 0; f < nfields; ++f) {
+        const auto* xf = x + f * size;
+        auto* mf       = mask.data() + f * words;
+        for (size_t i = 0; i < size; ++i) {
+            const auto valid = !std::isnan(xf[i]) && xf[i] != missing;
+            mf[i / 64] |= static_cast<uint64_t>(valid) << (i % 64);
+        }
+    }
+    return mask;
+}
+
+
+template <typename I, typename T, typename F>
+void apply_masked(const Matrix<I, T>& W, const F* x, const uint64_t* mask, F* y, size_t nfields, F missing,
+                  double fraction = 0.) {
+    // Fields are stored one after the other with their validity bitmasks; weighted sums and valid weights are
+    // accumulated in the same pass, and renormalised if the valid fraction (weights sum to one) is above fraction
+    const auto words = (W.Nc + 63) / 64;
+    for (size_t f = 0; f < nfields; f += FIELDS_BLOCK) {
+        const auto nb = std::min(FIELDS_BLOCK, nfields - f);
+        const auto* xf = x + f * W.Nc;
+        const auto* mf = mask + f * words;
+        auto* yf       = y + f * W.Nr;
+
+        for (size_t r = 0; r < W.Nr; ++r) {
+            double sum[FIELDS_BLOCK]   = {};
+            double valid[FIELDS_BLOCK] = {};
+            for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+                const auto w = static_cast<double>(W.a[k]);
+                const auto j = W.ja[k];
+                for (size_t b = 0; b < nb; ++b) {
+                    const auto v = (mf[b * words + j / 64] >> (j % 64)) & 1;
+                    sum[b] += v != 0 ? w * static_cast<double>(xf[b * W.Nc + j]) : 0.;
+                    valid[b] += w * static_cast<double>(v);
+                }
+            }
+            for (size_t b = 0; b < nb; ++b) {
+                yf[b * W.Nr + r] = valid[b] > fraction ? static_cast<F>(sum[b] / valid[b]) : missing;
+            }
+        }
+    }
+}
+
+
+template <typename I, typename T, typename F>
+void apply_masked(const RunMatrix<I, T>& W, const F* x, const uint64_t* mask, F* y, size_t nfields, F missing,
+                  double fraction = 0.) {
+    // As above, reading fields and bitmasks contiguously per run
+    const auto words = (W.Nc + 63) / 64;
+    for (size_t f = 0; f < nfields; f += FIELDS_BLOCK) {
+        const auto nb = std::min(FIELDS_BLOCK, nfields - f);
+        const auto* xf = x + f * W.Nc;
+        const auto* mf = mask + f * words;
+        auto* yf       = y + f * W.Nr;
+
+        const auto* a = W.a;
+        for (size_t r = 0; r < W.Nr; ++r) {
+            double sum[FIELDS_BLOCK]   = {};
+            double valid[FIELDS_BLOCK] = {};
+            for (auto k = W.rp[r]; k < W.rp[r + 1]; ++k) {
+                for (size_t l = 0, j = W.rs[k]; l < W.rl[k]; ++l, ++j) {
+                    const auto w = static_cast<double>(a[l]);
+                    for (size_t b = 0; b < nb; ++b) {
+                        const auto v = (mf[b * words + j / 64] >> (j % 64)) & 1;
+                        sum[b] += v != 0 ? w * static_cast<double>(xf[b * W.Nc + j]) : 0.;
+                        valid[b] += w * static_cast<double>(v);
+                    }
+                }
+                a += W.rl[k];
+            }
+            for (size_t b = 0; b < nb; ++b) {
+                yf[b * W.Nr + r] = valid[b] > fraction ? static_cast<F>(sum[b] / valid[b]) : missing;
+            }
+        }
+    }
+}
+
+
+struct minimum_t {
+    // Smallest value of the overlapping input grid-boxes
+    void reset() { m = std::numeric_limits<double>::infinity(); }
+    void add(double, double v) { m = std::min(m, v); }
+    double result() const { return m; }
+    double m = 0.;
+};
+
+
+struct maximum_t {
+    // Largest value of the overlapping input grid-boxes
+    void reset() { m = -std::numeric_limits<double>::infinity(); }
+    void add(double, double v) { m = std::max(m, v); }
+    double result() const { return m; }
+    double m = 0.;
+};
+
+
+struct variance_t {
+    // Area-weighted variance, by weighted running mean and sum of squared deviations (West, 1979)
+    void reset() { sum = mean = m2 = 0.; }
+    void add(double w, double v) {
+        sum += w;
+        const auto d = v - mean;
+        mean += d * w / sum;
+        m2 += w * d * (v - mean);
+    }
+    double result() const { return sum > 0. ? m2 / sum : std::numeric_limits<double>::quiet_NaN(); }
+    double sum  = 0.;
+    double mean = 0.;
+    double m2   = 0.;
+};
+
+
+struct majority_t {
+    // Value (category) covering the largest area, the smallest value on ties
+    void reset() { votes.clear(); }
+    void add(double w, double v) { votes.emplace_back(v, w); }
+    double result() {
+        if (votes.empty()) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+
+        std::sort(votes.begin(), votes.end());
+        auto best = votes.front();
+        for (auto t = votes.begin(); t != votes.end();) {
+            auto vote = std::make_pair(t->first, 0.);
+            for (; t != votes.end() && t->first == vote.first; ++t) {
+                vote.second += t->second;
+            }
+            best = vote.second > best.second ? vote : best;
+        }
+        return best.first;
+    }
+    std::vector<std::pair<double, double>> votes;  // Note: reused by all rows
+};
+
+
+template <typename Aggregation, typename I, typename T, typename F>
+void aggregate(const Matrix<I, T>& W, const F* x, const uint64_t* mask, F* y, size_t nfields, F missing,
+               double fraction = 0.) {
+    // Non-linear aggregation of the overlapping input grid-boxes values, weighted by overlap area (the weights), in one
+    // pass per field; with validity bitmasks (optional), invalid values are skipped and output is missing if the valid
+    // fraction is not above fraction
+    // Note: non-finite values are always skipped (as invalid, with or without bitmasks), so NaN never reaches an
+    // aggregation, and all aggregations treat them the same whatever their order
+    const auto words = (W.Nc + 63) / 64;
+    Aggregation agg;
+    for (size_t f = 0; f < nfields; ++f) {
+        const auto* xf = x + f * W.Nc;
+        const auto* mf = mask != nullptr ? mask + f * words : nullptr;
+        auto* yf       = y + f * W.Nr;
+
+        for (size_t r = 0; r < W.Nr; ++r) {
+            agg.reset();
+            double valid = 0.;
+            for (auto k = W.ia[r]; k < W.ia[r + 1]; ++k) {
+                const auto w = static_cast<double>(W.a[k]);
+                const auto j = W.ja[k];
+                const auto v = static_cast<double>(xf[j]);
+                if (w > 0. && (mf == nullptr || ((mf[j / 64] >> (j % 64)) & 1) != 0) && std::isfinite(v)) {
+                    agg.add(w, v);
+                    valid += w;
+                }
+            }
+            yf[r] = valid > fraction ? static_cast<F>(agg.result()) : missing;
+        }
+    }
+}
+
+
+template <typename F>
+void transpose(const F* a, F* b, size_t rows, size_t cols) {
+    // b[c * rows + r] = a[r * cols + c], by tiles fitting in cache (from/to fields one after the other)
+    constexpr size_t TILE = 32;
+    for (size_t r0 = 0; r0 < rows; r0 += TILE) {
+        const auto r1 = std::min(r0 + TILE, rows);
+        for (size_t c0 = 0; c0 < cols; c0 += TILE) {
+            const auto c1 = std::min(c0 + TILE, cols);
+            for (size_t r = r0; r < r1; ++r) {
+                for (size_t c = c0; c < c1; ++c) {
+                    b[c * rows + r] = a[r * cols + c];
+                }
+            }
+        }
+    }
+}
+
+
+template <typename F>
+size_t field_size(const std::string& path) {
+    // Number of values in a field file
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || static_cast<size_t>(st.st_size) % sizeof(F) != 0) {
+        throw std::runtime_error("Field: cannot read '" + path + "' (expecting " + type_name<F>() + " values)");
+    }
+    return static_cast<size_t>(st.st_size) / sizeof(F);
+}
+
+
+template <typename F>
+std::vector<F> read_field(const std::string& path, size_t size) {
+    std::vector<F> field(size);
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != size * sizeof(F)) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw std::runtime_error("Field: cannot read '" + path + "' (expecting " + std::to_string(size) + " " +
+                                 type_name<F>() + " values)");
+    }
+
+    auto* p = reinterpret_cast<char*>(field.data());
+    for (size_t n = size * sizeof(F); n > 0;) {
+        auto r = ::read(fd, p, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            ::close(fd);
+            throw std::runtime_error("Field: cannot read '" + path + "': " + std::strerror(errno));
+        }
+        p += r;
+        n -= static_cast<size_t>(r);
+    }
+
+    ::close(fd);
+    return field;
+}
+
+
+template <typename F>
+void write_field(const std::string& path, const std::vector<F>& field) {
+    auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Field: cannot create '" + path + "': " + std::strerror(errno));
+    }
+
+    const auto* p = reinterpret_cast<const char*>(field.data());
+    for (size_t n = field.size() * sizeof(F); n > 0;) {
+        auto w = ::write(fd, p, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            ::close(fd);
+            throw std::runtime_error("Field: cannot write '" + path + "': " + std::strerror(errno));
+        }
+        p += w;
+        n -= static_cast<size_t>(w);
+    }
+
+    if (::close(fd) != 0) {
+        throw std::runtime_error("Field: cannot write '" + path + "': " + std::strerror(errno));
+    }
+}
+
+
+struct Store {
+    // Weights shared between processes through a (memory-backed) directory: a matrix is written once, under a temporary
+    // name, and published by an atomic rename; readers map complete files read-only and never wait on a writer
+    explicit Store(const std::string& path) : path_(path) {
+        if (::mkdir(path_.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Store: cannot create '" + path_ + "': " + std::strerror(errno));
+        }
+    }
+
+    static std::string key(const std::string& gridi, const Area& areai, const std::string& grido, const Area& areao) {
+        // Note: areas exactly (hexfloat), as nearby areas (e.g. differing in the 7th significant digit) differ in size
+        std::ostringstream str;
+        auto area = [&str](const Area& a) {
+            str << std::hexfloat << a.N() << ',' << a.W() << ',' << a.S() << ',' << a.E() << std::defaultfloat;
+        };
+        str << gridi << '_';
+        area(areai);
+        str << '-' << grido << '_';
+        area(areao);
+        return str.str();
+    }
+
+    // Matrix published under key, if of the expected dimensions (Nr rows, Nc columns)
+    template <typename M>
+    bool load(const std::string& key, size_t Nr, size_t Nc, M& W) const {
+        const auto file = path_ + "/" + key + "." + M::layout();
+        auto fd         = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        const auto size = ::fstat(fd, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+        auto* addr      = size < sizeof(Header) ? MAP_FAILED : ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+
+        std::shared_ptr<const void> map(addr, [size](const void* p) { ::munmap(const_cast<void*>(p), size); });
+
+        const auto& h = *static_cast<const Header*>(addr);
+        if (std::memcmp(h.magic, Header().magic, sizeof(h.magic)) != 0 || h.version != VERSION ||
+            M::layout() != std::string(h.layout, ::strnlen(h.layout, sizeof(h.layout))) || h.nblocks > MAX_BLOCKS ||
+            h.Nr != Nr || h.Nc != Nc) {
+            return false;  // Note: incompatible or damaged, to be replaced by the caller
+        }
+
+        std::vector<block_t> blocks;
+        for (size_t n = 0; n < h.nblocks; ++n) {
+            if (h.blocks[n].offset + h.blocks[n].size > size) {
+                return false;
+            }
+            blocks.push_back({static_cast<const char*>(addr) + h.blocks[n].offset, h.blocks[n].size});
+        }
+
+        M V;
+        V.Nr = h.Nr;
+        V.Nc = h.Nc;
+        if (!V.attach(h.params, blocks)) {
+            return false;
+        }
+
+        V.storage = std::move(map);
+        W         = std::move(V);
+        return true;
+    }
+
+    template <typename M>
+    void publish(const std::string& key, const M& W) const {
+        const auto file = path_ + "/" + key + "." + M::layout();
+        const auto tmp  = file + "." + std::to_string(::getpid()) + ".tmp";
+
+        const auto blocks = W.blocks();
+        const auto params = W.params();
+        assert(blocks.size() <= MAX_BLOCKS);
+
+        Header h;
+        assert(M::layout().size() < sizeof(h.layout));
+        std::strncpy(h.layout, M::layout().c_str(), sizeof(h.layout) - 1);
+        std::copy(params.begin(), params.end(), h.params);
+        h.Nr      = W.Nr;
+        h.Nc      = W.Nc;
+        h.nblocks = blocks.size();
+
+        uint64_t offset = sizeof(Header);
+        for (size_t n = 0; n < h.nblocks; ++n) {
+            offset             = (offset + ALIGN - 1) / ALIGN * ALIGN;
+            h.blocks[n].offset = offset;
+            h.blocks[n].size   = blocks[n].size;
+            offset += blocks[n].size;
+        }
+
+        auto fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Store: cannot create '" + tmp + "': " + std::strerror(errno));
+        }
+
+        auto write = [fd, &tmp](const void* buf, size_t size, uint64_t offset) {
+            for (auto* p = static_cast<const char*>(buf); size > 0;) {
+                auto n = ::pwrite(fd, p, size, static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    ::close(fd);
+                    ::unlink(tmp.c_str());
+                    throw std::runtime_error("Store: cannot write '" + tmp + "': " + std::strerror(errno));
+                }
+                p += n;
+                size -= static_cast<size_t>(n);
+                offset += static_cast<uint64_t>(n);
+            }
+        };
+
+        write(&h, sizeof(h), 0);
+        for (size_t n = 0; n < h.nblocks; ++n) {
+            write(blocks[n].data, blocks[n].size, h.blocks[n].offset);
+        }
+
+        // Publish (replacing a concurrently published, identical matrix is harmless: existing mappings remain valid)
+        if (::fsync(fd) != 0 || ::close(fd) != 0 || ::rename(tmp.c_str(), file.c_str()) != 0) {
+            ::unlink(tmp.c_str());
+            throw std::runtime_error("Store: cannot publish '" + file + "': " + std::strerror(errno));
+        }
+    }
+
+private:
+    static constexpr uint64_t VERSION  = 3;
+    static constexpr uint64_t ALIGN    = 64;
+    static constexpr size_t MAX_BLOCKS = 8;
+
+    struct Header {
+        char magic[8]      = {'g', 'b', '-', 's', 'o', 'r', 't', '\0'};
+        uint64_t version   = VERSION;
+        char layout[16]    = {};
+        uint64_t params[4] = {};
+        uint64_t Nr        = 0;
+        uint64_t Nc        = 0;
+        uint64_t nblocks   = 0;
+        struct {
+            uint64_t offset = 0;
+            uint64_t size   = 0;  // bytes
+        } blocks[MAX_BLOCKS];
+    };
+
+    const std::string path_;
+};
+
+
+int main(int argc, const char* argv[]) {
+    try {
+        // options
+        std::unique_ptr<cxxopts::Options> parser(
+            new cxxopts::Options(argv[0], " - grid-box intersections interpolation method"));
+
+
+        parser->add_options()("h,help", "Print help");
+        parser->add_options()("input-grid", "Input grid", cxxopts::value<std::string>()->default_value("O9"));
+        parser->add_options()("input-area", "Input area", cxxopts::value<std::string>()->default_value(GLOBE_STR));
+        parser->add_options()("output-grid", "Output grid(s), remapped in the same sweep",
+                              cxxopts::value<std::vector<std::string>>()->default_value("O45"));
+        parser->add_options()("output-area", "Output area(s), one for all or one per output grid",
+                              cxxopts::value<std::vector<std::string>>()->default_value(GLOBE_STR));
+        parser->add_options()("method", "Interpolation method (conservative, conservative2, nearest, bilinear)",
+                              cxxopts::value<std::string>()->default_value("conservative"));
+        parser->add_options()("snap-tolerance", "Coincident grid-box edges tolerance (degrees, conservative methods)",
+                              cxxopts::value<double>()->default_value("0"));
+        parser->add_options()("prune", "Remove weights below this fraction of their row (rows keep their sum)",
+                              cxxopts::value<double>()->default_value("0"));
+        parser->add_options()("weights-store", "Weights store directory, shared by processes (e.g. /dev/shm/gb-sort)",
+                              cxxopts::value<std::string>());
+        parser->add_options()("layout", "Weights layout (csr, sell, runs)",
+                              cxxopts::value<std::string>()->default_value("csr"));
+        parser->add_options()("weights-type", "Weights type (double, float), always accumulated in double",
+                              cxxopts::value<std::string>()->default_value("double"));
+        parser->add_options()("input-field", "Input field(s) file (raw, native endianness)",
+                              cxxopts::value<std::string>());
+        parser->add_options()("output-field", "Output field(s) file, one per output grid",
+                              cxxopts::value<std::vector<std::string>>());
+        parser->add_options()("output-coverage", "Output grid-boxes covered fraction file, one per output grid",
+                              cxxopts::value<std::vector<std::string>>());
+        parser->add_options()("field-type", "Field type (double, float), always accumulated in double",
+                              cxxopts::value<std::string>()->default_value("double"));
+        parser->add_options()("fields", "Number of fields, one after the other",
+                              cxxopts::value<size_t>()->default_value("1"));
+        parser->add_options()("missing-value", "Missing value of input and output fields (default NaN)",
+                              cxxopts::value<double>());
+        parser->add_options()("input-mask", "Input field(s) validity bitmask file (ceil(N / 64) words per field)",
+                              cxxopts::value<std::string>());
+        parser->add_options()("min-valid-fraction", "Minimum valid input fraction, below which output is missing",
+                              cxxopts::value<double>()->default_value("0"));
+        parser->add_options()("aggregation",
+                              "Output grid-boxes aggregation of overlapping input values (mean, min, max, majority, "
+                              "variance), by area",
+                              cxxopts::value<std::string>()->default_value("mean"));
+        parser->add_options()("interleave", "Apply to fields interleaved (point-major, field-minor), transposing them");
+        parser->add_options()("matrix-free", "Remap fields during the sweep, without computing weights");
+        parser->add_options()("adjoint", "Apply the adjoint remapping (fields from output to input grid)");
+        parser->add_options()("compose-via", "Compose weights through an intermediate grid (cached if exact)",
+                              cxxopts::value<std::string>());
+        parser->add_options()("compose-via-area", "Intermediate grid area",
+                              cxxopts::value<std::string>()->default_value(GLOBE_STR));
+        parser->add_options()("extract-from-global",
+                              "Regional output weights as rows of the global output weights (cached), for grids "
+                              "cropped from a global grid (grid-boxes at the area limits are not clipped)");
+        parser->add_options()("query", "Output grid-box indices file (u64), weights of these only (without the sweep)",
+                              cxxopts::value<std::string>());
+        parser->add_options()("locate", "Locate points (file of latitude/longitude pairs) in the input grid",
+                              cxxopts::value<std::string>());
+        parser->add_options()("located", "Located input grid-box indices file (u64, maximum value if outside)",
+                              cxxopts::value<std::string>());
+        parser->add_options()("threads", "Number of threads (default: hardware concurrency)", cxxopts::value<size_t>());
+        parser->add_options()("benchmark", "Benchmark apply (number of repetitions)", cxxopts::value<size_t>());
+
+        parser->parse_positional({"input-grid", "output-grid"});
+
+        auto options = parser->parse(argc, argv);
+
+        if (options.count("help")) {
+            std::cout << parser->help() << std::endl;
+            return 0;
+        }
+
+        if (options.count("threads")) {
+            threads() = std::max<size_t>(1, options["threads"].as<size_t>());
+        }
+
+        snap_tolerance()  = options["snap-tolerance"].as<double>();
+        const auto thresh = options["prune"].as<double>();
+        if (snap_tolerance() < 0. || thresh < 0. || thresh >= 1.) {
+            throw std::runtime_error("Options --snap-tolerance/--prune expect a tolerance >= 0 and 0 <= threshold < 1");
+        }
+
+        const auto min_valid = options["min-valid-fraction"].as<double>();
+        if (min_valid < 0. || min_valid >= 1.) {
+            throw std::runtime_error("Option --min-valid-fraction expects 0 <= fraction < 1");
+        }
+
+
+        // input and output grids
+
+        const auto Gi = grid(options["input-grid"].as<std::string>(), {options["input-area"].as<std::string>()});
+
+        const auto output_grids = options["output-grid"].as<std::vector<std::string>>();
+        const auto output_areas = options["output-area"].as<std::vector<std::string>>();
+        if (output_areas.size() != 1 && output_areas.size() != output_grids.size()) {
+            throw std::runtime_error("Option --output-area expects one area, or one per output grid");
+        }
+
+        std::vector<std::shared_ptr<const Grid>> Go;
+        std::vector<const Grid*> grids;
+        for (size_t g = 0; g < output_grids.size(); ++g) {
+            Go.push_back(grid(output_grids[g], {output_areas[output_areas.size() == 1 ? 0 : g]}));
+            grids.push_back(Go.back().get());
+        }
+
+        // points (containing input grid-box, the batched locator verified against the scalar one)
+        if (options.count("locate")) {
+            if (!options.count("located")) {
+                throw std::runtime_error("Option --locate requires --located");
+            }
+
+            const auto path = options["locate"].as<std::string>();
+            const auto xy   = read_field<double>(path, field_size<double>(path));
+            const auto n    = xy.size() / 2;
+
+            std::vector<double> lat(n);
+            std::vector<double> lon(n);
+            for (size_t k = 0; k < n; ++k) {
+                lat[k] = xy[2 * k];
+                lon[k] = xy[2 * k + 1];
+            }
+
+            const Locator locate(*Gi);
+            std::vector<size_t> index(n);
+            auto start = std::chrono::steady_clock::now();
+            locate(lat.data(), lon.data(), n, index.data());
+            const auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            size_t diff = 0;
+            for (size_t k = 0; k < n; ++k) {
+                diff += locate(lat[k], lon[k]) == index[k] ? 0 : 1;
+            }
+
+            std::cout << "locate " << n << " points: " << t * 1e3 << " ms (" << diff << " differences to scalar)"
+                      << std::endl;
+            write_field(options["located"].as<std::string>(), index);
+            return 0;
+        }
+
+        std::shared_ptr<const Grid> Gm;
+        if (options.count("compose-via")) {
+            Gm = grid(options["compose-via"].as<std::string>(), {options["compose-via-area"].as<std::string>()});
+        }
+
+
+        // weights (from the store, if available), with the narrowest safe index type
+        const auto method = options["method"].as<std::string>();
+        if (method != "conservative" && method != "conservative2" && method != "nearest" && method != "bilinear") {
+            throw std::runtime_error("Unrecognized method '" + method + "'");
+        }
+
+        const auto layout = options["layout"].as<std::string>();
+        if (layout != "csr" && layout != "sell" && layout != "runs") {
+            throw std::runtime_error("Unrecognized layout '" + layout + "'");
+        }
+
+        const auto weights_type = options["weights-type"].as<std::string>();
+        if (weights_type != "double" && weights_type != "float") {
+            throw std::runtime_error("Unrecognized weights type '" + weights_type + "'");
+        }
+
+        const auto field_type = options["field-type"].as<std::string>();
+        if (field_type != "double" && field_type != "float") {
+            throw std::runtime_error("Unrecognized field type '" + field_type + "'");
+        }
+
+        const auto interleave = options.count("interleave") != 0;
+        if (interleave && layout == "sell") {
+            throw std::runtime_error("Option --interleave supports layouts csr and runs");
+        }
+
+        const auto masked = options.count("missing-value") != 0 || options.count("input-mask") != 0;
+        if (masked && (layout == "sell" || interleave)) {
+            throw std::runtime_error("Options --missing-value/--input-mask support layouts csr and runs");
+        }
+
+        const auto matrix_free = options.count("matrix-free") != 0;
+        if (matrix_free && (masked || interleave)) {
+            throw std::runtime_error("Option --matrix-free does not support --missing-value/--input-mask/--interleave");
+        }
+
+        const auto conservative = method == "conservative";
+
+        const auto aggregation = options["aggregation"].as<std::string>();
+        if (aggregation != "mean" && aggregation != "min" && aggregation != "max" && aggregation != "majority" &&
+            aggregation != "variance") {
+            throw std::runtime_error("Unrecognized aggregation '" + aggregation + "'");
+        }
+        if (aggregation != "mean" && (!conservative || layout != "csr" || interleave || matrix_free)) {
+            throw std::runtime_error("Option --aggregation supports method conservative and layout csr only");
+        }
+        if (!conservative && (matrix_free || Gm)) {
+            throw std::runtime_error("Options --matrix-free/--compose-via support method conservative only");
+        }
+
+        const auto adjoint = options.count("adjoint") != 0;
+        if (adjoint && (Go.size() != 1 || layout != "csr" || masked || interleave || matrix_free ||
+                        aggregation != "mean")) {
+            throw std::runtime_error("Option --adjoint supports one output grid and layout csr only");
+        }
+
+        const auto bench = options.count("benchmark") != 0;
+
+        std::unique_ptr<Store> store;
+        if (options.count("weights-store")) {
+            store.reset(new Store(options["weights-store"].as<std::string>()));
+        }
+
+        const auto extract = options.count("extract-from-global") != 0;
+
+        // calls f(index, value) with the narrowest safe index type and the requested weights type
+        auto dispatch = [&](auto&& f) {
+            auto size = Gm ? std::max(Gi->offsets().back(), Gm->offsets().back()) : Gi->offsets().back();
+            for (const auto& G : Go) {
+                size = std::max(size, G->offsets().back());
+            }
+
+            if (size < std::numeric_limits<uint32_t>::max()) {
+                weights_type == "float" ? f(uint32_t(), float()) : f(uint32_t(), double());
+            }
+            else {
+                weights_type == "float" ? f(uint64_t(), float()) : f(uint64_t(), double());
+            }
+        };
+
+        if (options.count("query")) {
+            // weights of the queried output grid-boxes (one output grid), and their fields in the same order
+            if (Go.size() != 1 || !conservative || Gm || matrix_free || extract) {
+                throw std::runtime_error("Option --query supports one output grid and method conservative only");
+            }
+            if (snap_tolerance() > 0. || thresh > 0.) {
+                throw std::runtime_error("Option --query does not support --snap-tolerance/--prune");
+            }
+
+            const auto path    = options["query"].as<std::string>();
+            const auto outputs = read_field<size_t>(path, field_size<size_t>(path));
+            const auto No      = Go.front()->offsets().back();
+            for (auto o : outputs) {
+                if (o >= No) {
+                    throw std::runtime_error("Option --query: output index " + std::to_string(o) + " out of range");
+                }
+            }
+
+            auto query = [&](auto index_type, auto value) {
+                using I = decltype(index_type);
+                using T = decltype(value);
+
+                const auto start = std::chrono::steady_clock::now();
+                const OverlapIndex index(*Gi, *Go.front());
+                Coverage C;
+                const auto W = index.query<I, T>(outputs, &C);
+                const auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::cout << W << std::endl;
+                std::cout << "query " << outputs.size() << " output grid-boxes: " << t * 1e3 << " ms" << std::endl;
+
+                auto query_fields = [&](auto field) {
+                    using F = decltype(field);
+
+                    const auto nfields = options["fields"].as<size_t>();
+                    const auto missing = options.count("missing-value")
+                                             ? static_cast<F>(options["missing-value"].as<double>())
+                                             : std::numeric_limits<F>::quiet_NaN();
+
+                    const auto x = read_field<F>(options["input-field"].as<std::string>(), nfields * W.Nc);
+                    std::vector<F> y(nfields * W.Nr);
+                    apply(W, x.data(), y.data(), nfields);
+                    for (size_t r = 0; r < W.Nr; ++r) {
+                        if (!(C.c[r] > 0.)) {
+                            for (size_t f = 0; f < nfields; ++f) {
+                                y[f * W.Nr + r] = missing;
+                            }
+                        }
+                    }
+                    write_field(options["output-field"].as<std::vector<std::string>>().front(), y);
+                };
+
+                if (options.count("input-field")) {
+                    if (!options.count("output-field")) {
+                        throw std::runtime_error("Option --input-field requires --output-field");
+                    }
+                    field_type == "float" ? query_fields(float()) : query_fields(double());
+                }
+            };
+
+            dispatch(query);
+            return 0;
+        }
+
+        // Note: cached apart from conservative, and from unsnapped/unpruned weights
+        std::ostringstream tuning;
+        if (snap_tolerance() > 0.) {
+            tuning << ".snap" << snap_tolerance();
+        }
+        const auto suffix = (conservative ? std::string() : "." + method) + tuning.str();
+
+        tuning.str("");
+        if (thresh > 0.) {
+            tuning << ".prune" << thresh;
+        }
+        const auto pruned = tuning.str();
+
+        // Note: keys by canonical grid names, as registered
+        const auto input_name = canonical(options["input-grid"].as<std::string>());
+        const auto via_name   = Gm ? canonical(options["compose-via"].as<std::string>()) : std::string();
+
+        std::vector<std::string> keys;
+        std::vector<std::string> keys_via;  // intermediate to output grids
+        std::vector<std::vector<size_t>> rows(Go.size());
+        for (size_t g = 0; g < Go.size(); ++g) {
+            if (extract && !(Go[g]->area() == GLOBE)) {
+                rows[g] = Go[g]->global_indices();
+            }
+
+            // Note: extracted weights are cached separately, as grid-boxes at the area limits are not clipped
+            const auto name = canonical(output_grids[g]) + suffix + pruned + (rows[g].empty() ? "" : ".global-rows");
+            keys.push_back(Store::key(input_name, Gi->area(), name, Go[g]->area()));
+            if (Gm) {
+                keys_via.push_back(
+                    Store::key(via_name, Gm->area(), canonical(output_grids[g]) + suffix, Go[g]->area()));
+            }
+        }
+
+        auto publish = [&store](const std::string& key, auto& W) {
+            if (store) {
+                store->publish(key, W);
+                if (!store->load(key, W.Nr, W.Nc, W)) {
+                    throw std::runtime_error("Store: cannot load '" + key + "'");
+                }
+            }
+        };
+
+        auto run = [&](auto index, auto value) {
+            using I = decltype(index);
+            using T = decltype(value);
+
+            // weights by the requested method (all output grids in the same sweep)
+            auto compute = [&method](const Grid& G, const std::vector<const Grid*>& out, std::vector<Coverage>* c) {
+                return method == "nearest"         ? nearest<I, T>(G, out, c)
+                       : method == "bilinear"      ? bilinear<I, T>(G, out, c)
+                       : method == "conservative2" ? weights2<I, T>(G, out, c)
+                                                   : weights<I, T>(G, out, c);
+            };
+
+            const auto K = Go.size();
+            std::vector<Matrix<I, T>> W(K);
+            std::vector<SellMatrix<I, T>> S(K);
+            std::vector<RunMatrix<I, T>> R(K);
+            std::vector<Coverage> C(K);
+
+            // weights (any layout) with their coverage, from the store (if of the grids dimensions)
+            auto load = [&store](const std::string& key, const Grid& out, const Grid& in, auto& M, Coverage& c) {
+                const auto Nr = out.offsets().back();
+                return store && store->load(key, Nr, in.offsets().back(), M) && store->load(key, Nr, 0, c);
+            };
+
+            // requested layouts from the store, then the csr weights they need (missing ones computed in one sweep)
+            std::vector<size_t> need;
+            for (size_t g = 0; g < K && (!matrix_free || bench); ++g) {
+                const auto found = layout == "sell"   ? load(keys[g], *Go[g], *Gi, S[g], C[g])
+                                   : layout == "runs" ? load(keys[g], *Go[g], *Gi, R[g], C[g])
+                                                      : false;
+                if (!found || bench) {
+                    need.push_back(g);
+                }
+            }
+
+            std::vector<const Grid*> missing;
+            std::vector<size_t> missing_g;
+            for (auto g : need) {
+                if (!load(keys[g], *Go[g], *Gi, W[g], C[g])) {
+                    missing.push_back(grids[g]);
+                    missing_g.push_back(g);
+                }
+            }
+
+            // weights without the smallest, if requested (reporting the removed non-zeros)
+            auto prune_weights = [&](size_t g) {
+                if (thresh > 0.) {
+                    auto P = prune(W[g], thresh);
+                    std::cout << "prune " << output_grids[g] << ": " << W[g].nnz() - P.nnz() << " of " << W[g].nnz()
+                              << " non-zeros removed" << std::endl;
+                    W[g] = std::move(P);
+                }
+            };
+
+            if (extract) {
+                // regional weights as rows of the global weights (cached, or computed in one sweep)
+                std::vector<std::shared_ptr<const Grid>> global;
+                std::vector<std::string> global_keys;
+                std::vector<Matrix<I, T>> Wg;
+                std::vector<Coverage> Cg;
+                std::vector<const Grid*> global_missing;
+                std::vector<size_t> global_missing_k;
+
+                std::vector<const Grid*> remaining;
+                std::vector<size_t> remaining_g;
+                for (size_t m = 0; m < missing.size(); ++m) {
+                    const auto g = missing_g[m];
+                    if (rows[g].empty()) {
+                        remaining.push_back(missing[m]);
+                        remaining_g.push_back(g);
+                        continue;
+                    }
+
+                    global.push_back(grid(output_grids[g]));
+                    global_keys.push_back(
+                        Store::key(input_name, Gi->area(), canonical(output_grids[g]) + suffix, GLOBE));
+                    Wg.emplace_back();
+                    Cg.emplace_back();
+                    if (!load(global_keys.back(), *global.back(), *Gi, Wg.back(), Cg.back())) {
+                        global_missing.push_back(global.back().get());
+                        global_missing_k.push_back(Wg.size() - 1);
+                    }
+                }
+
+                std::vector<Coverage> Cs;
+                auto Ws = global_missing.empty() ? std::vector<Matrix<I, T>>() : compute(*Gi, global_missing, &Cs);
+                for (size_t v = 0; v < global_missing.size(); ++v) {
+                    const auto k = global_missing_k[v];
+                    Wg[k]        = std::move(Ws[v]);
+                    Cg[k]        = std::move(Cs[v]);
+                    publish(global_keys[k], Wg[k]);
+                    publish(global_keys[k], Cg[k]);
+                }
+
+                for (size_t m = 0, k = 0; m < missing.size(); ++m) {
+                    const auto g = missing_g[m];
+                    if (!rows[g].empty()) {
+                        W[g] = extract_rows(Wg[k], rows[g]);
+                        C[g] = extract_rows(Cg[k++], rows[g]);
+                        prune_weights(g);
+                        publish(keys[g], W[g]);
+                        publish(keys[g], C[g]);
+                    }
+                }
+
+                missing.swap(remaining);
+                missing_g.swap(remaining_g);
+            }
+
+            std::vector<bool> cache(K, true);  // Note: approximate compositions are not published
+            if (!missing.empty() && Gm) {
+                // weights through the intermediate grid (cached, or computed in one sweep), composed
+                Matrix<I, T> A;
+                Coverage CA;
+                const auto key = Store::key(input_name, Gi->area(), via_name + suffix, Gm->area());
+                if (!load(key, *Gm, *Gi, A, CA)) {
+                    std::vector<Coverage> Cs;
+                    A  = std::move(weights<I, T>(*Gi, {Gm.get()}, &Cs).front());
+                    CA = std::move(Cs.front());
+                    publish(key, A);
+                    publish(key, CA);
+                }
+
+                std::vector<Matrix<I, T>> B(missing.size());
+                std::vector<Coverage> CB(missing.size());
+                std::vector<const Grid*> missing_via;
+                std::vector<size_t> missing_m;
+                for (size_t m = 0; m < missing.size(); ++m) {
+                    if (!load(keys_via[missing_g[m]], *missing[m], *Gm, B[m], CB[m])) {
+                        missing_via.push_back(missing[m]);
+                        missing_m.push_back(m);
+                    }
+                }
+
+                std::vector<Coverage> Cs;
+                auto Bs = missing_via.empty() ? std::vector<Matrix<I, T>>() : weights<I, T>(*Gm, missing_via, &Cs);
+                for (size_t v = 0; v < missing_via.size(); ++v) {
+                    const auto m = missing_m[v];
+                    B[m]         = std::move(Bs[v]);
+                    CB[m]        = std::move(Cs[v]);
+                    publish(keys_via[missing_g[m]], B[m]);
+                    publish(keys_via[missing_g[m]], CB[m]);
+                }
+
+                for (size_t m = 0; m < missing.size(); ++m) {
+                    const auto g     = missing_g[m];
+                    const auto start = std::chrono::steady_clock::now();
+                    W[g]             = compose(B[m], A);
+                    const auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                    // coverage, of the output by the intermediate grid times that of the intermediate by the input grid
+                    std::vector<double> c(B[m].Nr);
+                    apply(B[m], CA.c, c.data());
+                    for (size_t o = 0; o < c.size(); ++o) {
+                        c[o] *= CB[m].c[o];
+                    }
+                    C[g] = Coverage(std::move(c));
+
+                    cache[g] = nested(*Gm, *Gi) || nested(*Gm, *Go[g]);
+                    std::cout << "compose " << output_grids[g] << " via " << options["compose-via"].as<std::string>()
+                              << ": " << t * 1e3 << " ms (" << (cache[g] ? "exact" : "approximate") << ")"
+                              << std::endl;
+                }
+            }
+            else if (!missing.empty()) {
+                std::vector<Coverage> Cs;
+                auto Ws = compute(*Gi, missing, &Cs);
+                for (size_t m = 0; m < missing.size(); ++m) {
+                    W[missing_g[m]] = std::move(Ws[m]);
+                    C[missing_g[m]] = std::move(Cs[m]);
+                }
+            }
+
+            for (auto g : missing_g) {
+                prune_weights(g);
+                if (cache[g]) {
+                    publish(keys[g], W[g]);
+                    publish(keys[g], C[g]);
+                }
+            }
+
+            for (auto g : need) {
+                if ((layout == "sell" || bench) && S[g].sp == nullptr) {
+                    S[g] = SellMatrix<I, T>(W[g]);
+                    if (cache[g]) {
+                        publish(keys[g], S[g]);
+                    }
+                }
+                if ((layout == "runs" || bench) && R[g].rp == nullptr) {
+                    R[g] = RunMatrix<I, T>(W[g]);
+                    if (cache[g]) {
+                        publish(keys[g], R[g]);
+                    }
+                }
+            }
+
+            for (size_t g = 0; g < K && (!matrix_free || bench); ++g) {
+                if (layout == "csr" || bench) {
+                    std::cout << W[g] << std::endl;
+                }
+                if (layout == "sell" || bench) {
+                    std::cout << S[g] << std::endl;
+                }
+                if (layout == "runs" || bench) {
+                    std::cout << R[g] << std::endl;
+                }
+            }
+
+
+            // fields (one after the other, accumulated in double)
+            auto apply_fields = [&](auto field) {
+                using F = decltype(field);
+
+                const auto nfields = options["fields"].as<size_t>();
+                const auto Ni      = Gi->offsets().back();
+                const auto missing = options.count("missing-value")
+                                         ? static_cast<F>(options["missing-value"].as<double>())
+                                         : std::numeric_limits<F>::quiet_NaN();
+
+                auto apply_layout = [&](size_t g, const std::vector<F>& x, std::vector<F>& y) {
+                    const auto No = Go[g]->offsets().back();
+                    if (interleave) {
+                        std::vector<F> xt(x.size());
+                        std::vector<F> yt(y.size());
+                        transpose(x.data(), xt.data(), nfields, Ni);
+                        layout == "csr" ? apply_interleaved(W[g], xt.data(), yt.data(), nfields)
+                                        : apply_interleaved(R[g], xt.data(), yt.data(), nfields);
+                        transpose(yt.data(), y.data(), No, nfields);
+                        return;
+                    }
+
+                    layout == "csr"    ? apply(W[g], x.data(), y.data(), nfields)
+                    : layout == "sell" ? apply(S[g], x.data(), y.data(), nfields)
+                                       : apply(R[g], x.data(), y.data(), nfields);
+                };
+
+                if (adjoint && options.count("input-field")) {
+                    if (!options.count("output-field")) {
+                        throw std::runtime_error("Option --input-field requires --output-field");
+                    }
+
+                    const auto x =
+                        read_field<F>(options["input-field"].as<std::string>(), nfields * Go.front()->offsets().back());
+                    std::vector<F> y(nfields * Ni);
+                    apply_transpose(W.front(), x.data(), y.data(), nfields);
+                    write_field(options["output-field"].as<std::vector<std::string>>().front(), y);
+                }
+                else if (options.count("input-field")) {
+                    const auto paths =
+                        options.count("output-field") ? options["output-field"].as<std::vector<std::string>>()
+                                                      : std::vector<std::string>();
+                    if (paths.size() != K) {
+                        throw std::runtime_error("Option --input-field requires --output-field, one per output grid");
+                    }
+
+                    const auto x = read_field<F>(options["input-field"].as<std::string>(), nfields * Ni);
+                    std::vector<std::vector<F>> y;
+                    std::vector<F*> ys;
+                    for (size_t g = 0; g < K; ++g) {
+                        y.emplace_back(nfields * Go[g]->offsets().back());
+                        ys.push_back(y.back().data());
+                    }
+
+                    if (matrix_free) {
+                        C.clear();
+                        remap(*Gi, grids, x.data(), ys, nfields, &C);
+                    }
+                    else if (aggregation != "mean") {
+                        const auto fraction = min_valid;
+
+                        const auto words = nfields * ((Ni + 63) / 64);
+                        const auto mask  = !masked ? std::vector<uint64_t>()
+                                           : options.count("input-mask")
+                                               ? read_field<uint64_t>(options["input-mask"].as<std::string>(), words)
+                                               : validity(x.data(), Ni, nfields, missing);
+                        const auto* m = masked ? mask.data() : nullptr;
+
+                        auto aggregate_with = [&](auto agg) {
+                            for (size_t g = 0; g < K; ++g) {
+                                aggregate<decltype(agg)>(W[g], x.data(), m, ys[g], nfields, missing, fraction);
+                            }
+                        };
+                        aggregation == "min"        ? aggregate_with(minimum_t())
+                        : aggregation == "max"      ? aggregate_with(maximum_t())
+                        : aggregation == "majority" ? aggregate_with(majority_t())
+                                                    : aggregate_with(variance_t());
+                    }
+                    else if (masked) {
+                        const auto fraction = min_valid;
+
+                        const auto words = nfields * ((Ni + 63) / 64);
+                        const auto mask  = options.count("input-mask")
+                                               ? read_field<uint64_t>(options["input-mask"].as<std::string>(), words)
+                                               : validity(x.data(), Ni, nfields, missing);
+
+                        for (size_t g = 0; g < K; ++g) {
+                            layout == "csr"
+                                ? apply_masked(W[g], x.data(), mask.data(), ys[g], nfields, missing, fraction)
+                                : apply_masked(R[g], x.data(), mask.data(), ys[g], nfields, missing, fraction);
+                        }
+                    }
+                    else {
+                        for (size_t g = 0; g < K; ++g) {
+                            apply_layout(g, x, y[g]);
+                        }
+                    }
+
+                    // output grid-boxes outside the input grid are missing
+                    for (size_t g = 0; g < K; ++g) {
+                        const auto No = Go[g]->offsets().back();
+                        for (size_t o = 0; o < No; ++o) {
+                            if (!(C[g].c[o] > 0.)) {
+                                for (size_t f = 0; f < nfields; ++f) {
+                                    y[g][f * No + o] = missing;
+                                }
+                            }
+                        }
+                        write_field(paths[g], y[g]);
+                    }
+                }
+
+                if (options.count("output-coverage")) {
+                    const auto paths = options["output-coverage"].as<std::vector<std::string>>();
+                    if (paths.size() != K || (matrix_free && !options.count("input-field"))) {
+                        throw std::runtime_error(
+                            "Option --output-coverage requires one file per output grid (and --input-field, with "
+                            "--matrix-free)");
+                    }
+                    for (size_t g = 0; g < K; ++g) {
+                        write_field(paths[g], std::vector<double>(C[g].c, C[g].c + C[g].Nr));
+                    }
+                }
+
+                // benchmark (random input fields, differences relative to csr)
+                if (bench) {
+                    const auto n = options["benchmark"].as<size_t>();
+
+                    std::vector<F> x(nfields * Ni);
+                    std::mt19937_64 gen(1);
+                    std::uniform_real_distribution<F> dist(-1., 1.);
+                    std::generate(x.begin(), x.end(), [&]() { return dist(gen); });
+
+                    std::vector<F> xt(x.size());
+                    auto start = std::chrono::steady_clock::now();
+                    transpose(x.data(), xt.data(), nfields, Ni);
+                    std::cout << "transpose: "
+                              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e3
+                              << " ms" << std::endl;
+
+                    std::vector<std::vector<F>> ref;
+                    for (size_t g = 0; g < K; ++g) {
+                        const auto No = Go[g]->offsets().back();
+                        ref.emplace_back(nfields * No);
+                        apply(W[g], x.data(), ref.back().data(), nfields);
+
+                        auto report = [&ref, g](const std::string& name, double t, const std::vector<F>& y) {
+                            double diff = 0.;
+                            for (size_t r = 0; r < y.size(); ++r) {
+                                diff = std::max(diff,
+                                                std::abs(static_cast<double>(y[r]) - static_cast<double>(ref[g][r])));
+                            }
+                            std::cout << "apply " << name << ": " << t * 1e3 << " ms (max difference " << diff << ")"
+                                      << std::endl;
+                        };
+
+                        auto time = [&](const std::string& name, const auto& M) {
+                            std::vector<F> y(ref[g].size());
+                            const auto start = std::chrono::steady_clock::now();
+                            for (size_t k = 0; k < n; ++k) {
+                                apply(M, x.data(), y.data(), nfields);
+                            }
+                            report(name,
+                                   std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n,
+                                   y);
+                        };
+
+                        // interleaved fields (excluding transposition, timed above)
+                        auto time_interleaved = [&](const std::string& name, const auto& M) {
+                            std::vector<F> yt(ref[g].size());
+                            const auto start = std::chrono::steady_clock::now();
+                            for (size_t k = 0; k < n; ++k) {
+                                apply_interleaved(M, xt.data(), yt.data(), nfields);
+                            }
+                            const auto t =
+                                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n;
+
+                            std::vector<F> y(yt.size());
+                            transpose(yt.data(), y.data(), No, nfields);
+                            report(name + " (interleaved)", t, y);
+                        };
+
+                        time("csr", W[g]);
+                        time("sell", S[g]);
+                        time("runs", R[g]);
+                        time_interleaved("csr", W[g]);
+                        time_interleaved("runs", R[g]);
+
+                        // NaN (the default missing value) at the first input point reaches the same outputs
+                        {
+                            auto xn = x;
+                            for (size_t f = 0; f < nfields; ++f) {
+                                xn[f * Ni] = std::numeric_limits<F>::quiet_NaN();
+                            }
+
+                            std::vector<F> yc(ref[g].size());
+                            apply(W[g], xn.data(), yc.data(), nfields);
+                            auto differences = [&](const auto& M) {
+                                std::vector<F> y(yc.size());
+                                apply(M, xn.data(), y.data(), nfields);
+                                size_t differ = 0;
+                                for (size_t r = 0; r < y.size(); ++r) {
+                                    differ += y[r] == yc[r] || (std::isnan(y[r]) && std::isnan(yc[r])) ? 0 : 1;
+                                }
+                                return differ;
+                            };
+                            std::cout << "apply NaN input: " << differences(S[g]) << " (sell) and "
+                                      << differences(R[g]) << " (runs) differences to csr" << std::endl;
+                        }
+
+                        // adjoint, by transposed weights and without (output grid fields are the csr results)
+                        auto start    = std::chrono::steady_clock::now();
+                        const auto Wt = transpose(W[g]);
+                        auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                        std::cout << "transpose weights: " << t * 1e3 << " ms" << std::endl;
+
+                        std::vector<F> yt(x.size());
+                        std::vector<F> ya(x.size());
+                        apply(Wt, ref[g].data(), yt.data(), nfields);
+
+                        start = std::chrono::steady_clock::now();
+                        for (size_t k = 0; k < n; ++k) {
+                            apply_transpose(W[g], ref[g].data(), ya.data(), nfields);
+                        }
+                        t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n;
+
+                        double diff = 0.;
+                        for (size_t r = 0; r < ya.size(); ++r) {
+                            diff = std::max(diff, std::abs(static_cast<double>(ya[r]) - static_cast<double>(yt[r])));
+                        }
+                        std::cout << "apply adjoint: " << t * 1e3 << " ms (max difference " << diff
+                                  << " to transposed csr)" << std::endl;
+
+                        // majority of categories with NaN values (skipped, as if masked)
+                        std::vector<F> xc(x.size());
+                        for (size_t i = 0; i < xc.size(); ++i) {
+                            xc[i] = i % 7 == 0 ? std::numeric_limits<F>::quiet_NaN() : std::round(2 * x[i]);
+                        }
+                        const auto nan  = std::numeric_limits<F>::quiet_NaN();
+                        const auto mask = validity(xc.data(), Ni, nfields, nan);
+
+                        std::vector<F> yc(ref[g].size());
+                        std::vector<F> ym(ref[g].size());
+                        start = std::chrono::steady_clock::now();
+                        for (size_t k = 0; k < n; ++k) {
+                            aggregate<majority_t>(W[g], xc.data(), nullptr, yc.data(), nfields, nan);
+                        }
+                        t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n;
+                        aggregate<majority_t>(W[g], xc.data(), mask.data(), ym.data(), nfields, nan);
+
+                        size_t differ = 0;
+                        for (size_t r = 0; r < yc.size(); ++r) {
+                            differ += yc[r] == ym[r] || (std::isnan(yc[r]) && std::isnan(ym[r])) ? 0 : 1;
+                        }
+                        std::cout << "aggregate majority: " << t * 1e3 << " ms (" << differ
+                                  << " differences to masked, with NaN input)" << std::endl;
+                    }
+
+                    // input grid-box edges, of all rows in bulk (differences to scalar midpoints)
+                    {
+                        start        = std::chrono::steady_clock::now();
+                        const auto E = Gi->lon_edges();
+                        const auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                        size_t diff  = 0;
+                        const auto& O = Gi->offsets();
+                        for (size_t j = 0; j < Gi->Nj(); ++j) {
+                            for (size_t k = 0; k <= Gi->Ni(j); ++k) {
+                                const auto& e = E[O[j] + j + k];
+                                diff += e.x == Gi->lon_edge(j, k) && e.i == 0 ? 0 : 1;
+                            }
+                        }
+                        std::cout << "edges: " << t * 1e3 << " ms (" << diff << " differences to scalar)"
+                                  << std::endl;
+                    }
+
+                    // weights computation and matrix-free remapping (all output grids in the same sweep)
+                    start        = std::chrono::steady_clock::now();
+                    const auto M = compute(*Gi, grids, nullptr);
+                    std::cout << "weights: "
+                              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e3
+                              << " ms" << std::endl;
+
+                    // the same weights as separate sweeps, up to rounding (other output grids edges split bands and
+                    // segments, so the same intersections are summed in other pieces)
+                    for (size_t g = 0; g < K && K > 1; ++g) {
+                        const auto S1 = std::move(compute(*Gi, {grids[g]}, nullptr).front());
+
+                        size_t differ = 0;
+                        double diff   = 0.;
+                        for (size_t r = 0; r < S1.Nr; ++r) {
+                            const auto n = S1.ia[r + 1] - S1.ia[r];
+                            if (M[g].ia[r + 1] - M[g].ia[r] != n ||
+                                !std::equal(S1.ja + S1.ia[r], S1.ja + S1.ia[r + 1], M[g].ja + M[g].ia[r])) {
+                                ++differ;
+                                continue;
+                            }
+                            for (size_t k = 0; k < n; ++k) {
+                                diff = std::max(diff, std::abs(static_cast<double>(M[g].a[M[g].ia[r] + k]) -
+                                                               static_cast<double>(S1.a[S1.ia[r] + k])));
+                            }
+                        }
+                        std::cout << "weights " << output_grids[g] << ": " << differ
+                                  << " rows of other non-zeros, max difference " << diff << " (to a separate sweep)"
+                                  << std::endl;
+                    }
+                    if (!conservative) {
+                        return;
+                    }
+
+                    std::vector<std::vector<F>> y;
+                    std::vector<F*> ys;
+                    for (size_t g = 0; g < K; ++g) {
+                        y.emplace_back(ref[g].size());
+                        ys.push_back(y.back().data());
+                    }
+
+                    start = std::chrono::steady_clock::now();
+                    for (size_t k = 0; k < n; ++k) {
+                        remap(*Gi, grids, x.data(), ys, nfields);
+                    }
+                    const auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n;
+
+                    double diff = 0.;
+                    for (size_t g = 0; g < K; ++g) {
+                        for (size_t r = 0; r < y[g].size(); ++r) {
+                            diff = std::max(
+                                diff, std::abs(static_cast<double>(y[g][r]) - static_cast<double>(ref[g][r])));
+                        }
+                    }
+
+                    std::cout << "remap matrix-free: " << t * 1e3 << " ms (max difference " << diff << ")"
+                              << std::endl;
+                }
+            };
+
+            field_type == "float" ? apply_fields(float()) : apply_fields(double());
+        };
+
+        dispatch(run);
+    }
+    catch (const cxxopts::exceptions::exception& e) {
+        std::cout << "error parsing options: " << e.what() << std::endl;
+        return 1;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
         return 1;
     }
 